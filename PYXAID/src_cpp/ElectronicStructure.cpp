@@ -22,12 +22,39 @@ using namespace std;
 //===================== Class ElectronicStructure ============================
 
 double ElectronicStructure::energy(){
-  double res = ( (*Ccurr).H() * (*Hcurr) * (*Ccurr)).M[0].real(); //0.0;
+  matrix H(num_states,num_states);  Hcurr->unpack(H);
+  double res = ( (*Ccurr).H() * H * (*Ccurr)).M[0].real(); //0.0;
   return res;
 }
 
 void ElectronicStructure::update_populations(){
-  *A = ((*Ccurr).conj()) * ((*Ccurr).T());
+// Takes a snapshot of Ccurr: A = C^* x C^T is now defined by these coefficients,
+// but the full matrix is only built by density_matrix(). Populations and 
+// coherences are available from population() and coherence()
+  int n = num_states;
+  if((int)C_A.size()!=n){ C_A = vector< complex<double> >(n,complex<double>(0.0,0.0)); }
+  for(int i=0;i<n;i++){ C_A[i] = Ccurr->M[i]; }
+  is_A = 0;
+}
+
+double ElectronicStructure::population(int i){
+  return (conj(C_A[i])*C_A[i]).real();
+}
+
+complex<double> ElectronicStructure::coherence(int i,int j){
+  return conj(C_A[i])*C_A[j];
+}
+
+matrix& ElectronicStructure::density_matrix(){
+// Builds the full density matrix A, if it is not up to date
+  int n = num_states;
+  if(!is_A){
+    for(int i=0;i<n;i++){
+      for(int j=0;j<n;j++){  A->M[i*n+j] = conj(C_A[i])*C_A[j];  }
+    }
+    is_A = 1;
+  }
+  return *A;
 }
 
 double ElectronicStructure::norm(){
@@ -36,27 +63,29 @@ double ElectronicStructure::norm(){
 
 
 void ElectronicStructure::update_decoherence_times(matrix& rates){
-
-  update_populations();
-
-  for(int i=0;i<num_states;i++){
-    tau_m[i] = 0.0;
-    for(int j=0;j<num_states;j++){
-      tau_m[i] += A->M[j*num_states+j].real()*rates.M[i*num_states+j].real(); 
-    }// for j
+// tau_m = R * p: decoherence rates of all states, with p being the populations of the
+// current snapshot (see update_populations), which is the caller's responsibility to take
+  int n = num_states;
+  if((int)pop.size()!=n){ pop = vector<double>(n,0.0); }
+  for(int j=0;j<n;j++){ pop[j] = population(j); }
+
+  for(int i=0;i<n;i++){
+    complex<double>* R_i = &rates.M[i*n];
+    double sum = 0.0;
+    for(int j=0;j<n;j++){ sum += pop[j]*R_i[j].real(); }
+    tau_m[i] = sum;
   }// for i
 }
 
 void ElectronicStructure::project_out(int i){
   // Project out state i
-  Ccurr->M[i] = 0.0;
-
-  // Normalize the rest of the wavefunction
+  // Only c_i is zeroed and the rest is renormalized, so the snapshot C_A is updated along with Ccurr
   double nrm = 0.0;
-  for(int j=0;j<num_states;j++){ if(j!=i){ nrm += A->M[j*num_states+j].real(); }   }  nrm = sqrt(nrm);
-  for(j=0;j<num_states;j++){  Ccurr->M[j] /= nrm; }
-   
-  update_populations();
+  for(int j=0;j<num_states;j++){ if(j!=i){ nrm += population(j); }   }  nrm = sqrt(nrm);
+
+  Ccurr->M[i] = 0.0;  C_A[i] = 0.0;
+  for(int j=0;j<num_states;j++){  Ccurr->M[j] /= nrm;  C_A[j] = Ccurr->M[j]; }
+  is_A = 0;
 
 }
 
@@ -69,21 +98,25 @@ void ElectronicStructure::decohere(int i){
 
 
 void ElectronicStructure::check_decoherence(double dt,int boltz_flag,double Temp,matrix& rates){
+// Populations are taken from the last update_populations() snapshot
 
   update_decoherence_times(rates);
 
+  // Boltzmann factors for hops from the current state (no field with decoherence)
+  update_boltz_factors(NULL,0.0,Temp);
+  double* bf_c = boltz_factors(curr_state);
+
   for(int i=0;i<num_states;i++){
     double rnd_i = 1.0/tau_m[i];  // Simplest implementation
 
     if(t_m[i]>=rnd_i) { // Decoherence event occurs for state i
 
         double zeta = uniform(0.0,1.0);
-        double P = A->M[i*num_states+i].real(); // probability to decohere
+        double P = population(i); // probability to decohere
 
         // In leu of hop rejection use Boltzmann factors
 //        if(boltz_flag==1){
-          double dE = (Hcurr->M[i*num_states+i] - Hcurr->M[curr_state*num_states+curr_state]).real();
-          if(dE>0){  P *= exp(-(dE/(kb*Temp))); }  // hop to higher energy state is difficult
+          P *= bf_c[i];  // hop to higher energy state is difficult
 //        }
 
         if(zeta < P){       // Hop to the state i from current state with probability P
@@ -101,12 +134,66 @@ void ElectronicStructure::check_decoherence(double dt,int boltz_flag,double Temp
     }// for i
 
   // Advancing time
-  for(i=0;i<num_states;i++){  t_m[i] += dt; }
+  for(int i=0;i<num_states;i++){  t_m[i] += dt; }
 
 }
 
 
 
+void ElectronicStructure::reset_decoherence_events(){
+// Start of a new trajectory: the decoherence rates are recomputed on the next call of check_decoherence_events
+  dish_p.clear();  dish_repredict = 0;
+}
+
+void ElectronicStructure::check_decoherence_events(double dt,int boltz_flag,double Temp,matrix& rates,double tol){
+// Same as check_decoherence - the same clocks t_m, test for an event and order of the events - but the
+// decoherence rates tau_m = R * p are recomputed only when some population has changed by more than tol
+// since the last update, or after an event. Otherwise the rates of the previous step are reused.
+// With tol = 0 the result is identical to that of check_decoherence
+// Populations are taken from the last update_populations() snapshot
+// Cost per step: O(N) for the population drift check and the event test, plus O(N^2) for each update
+// of the rates (done every step in check_decoherence)
+  int n = num_states;
+
+  int upd = (dish_repredict || (int)dish_p.size()!=n);
+  for(int j=0;j<n && !upd;j++){  if(fabs(population(j)-dish_p[j])>tol){ upd = 1; }  }
+  if(upd){
+    update_decoherence_times(rates);
+    dish_p = pop;
+    dish_repredict = 0;
+  }
+
+  double* bf_c = NULL;
+  for(int i=0;i<n;i++){
+    if(t_m[i]>=1.0/tau_m[i]) { // Decoherence event occurs for state i
+
+      // Boltzmann factors for hops from the current state (no field with decoherence)
+      if(bf_c==NULL){  update_boltz_factors(NULL,0.0,Temp);  bf_c = boltz_factors(curr_state);  }
+
+      double zeta = uniform(0.0,1.0);
+      double P = population(i) * bf_c[i]; // probability to decohere
+
+      dish_repredict = 1; // the populations have changed: update the rates on the next step
+
+      if(zeta < P){       // Hop to the state i from current state with probability P
+        decohere(i);
+        break;            // only one even per time step
+      }
+      else{  project_out(i);   }
+
+      // Reset the time axis for state i
+      t_m[i] = 0;
+      tau_m[i] = 0.0;
+
+    }// t_m[i]>=1.0/tau_m
+  }// for i
+
+  // Advancing time
+  for(int i=0;i<n;i++){  t_m[i] += dt; }
+
+}
+
+
 void ElectronicStructure::update_hop_prob(double dt,int boltz_flag, double Temp,matrix& Ef){
 /*******************************************************
  (Re-)Calculate hopping probabilities from given state 
@@ -114,7 +201,7 @@ void ElectronicStructure::update_hop_prob(double dt,int boltz_flag, double Temp,
   update_populations();
 
   for(int i=0;i<num_states;i++){
-    double a_ii = A->M[i*num_states+i].real(); 
+    double a_ii = population(i); 
     if (a_ii==0.0){ a_ii = 1e-12; }
 
     double sum = 0.0;
@@ -127,23 +214,23 @@ void ElectronicStructure::update_hop_prob(double dt,int boltz_flag, double Temp,
         // Hprime* at this moment is -i*hbar*<i|p|j>, Ef will include: 2*e/m_e * A(t) * cos(omega*t)
 
         // warning!!!: Before 4/15/2013 there was "-" sign in the line below
-        complex<double> Hij = Hcurr->M[i*num_states+j] + 
-                     Ef.M[0]*Hprimex->M[i*num_states+j] + 
-                     Ef.M[1]*Hprimey->M[i*num_states+j] +
-                     Ef.M[2]*Hprimez->M[i*num_states+j];
-        double E_i = (Hcurr->M[i*num_states+i] + 
-                      Ef.M[0]*Hprimex->M[i*num_states+i] + 
-                      Ef.M[1]*Hprimex->M[i*num_states+i] +
-                      Ef.M[2]*Hprimex->M[i*num_states+i]
+        complex<double> Hij = Hcurr->get(i,j) + 
+                     Ef.M[0]*Hprimex->get(i,j) + 
+                     Ef.M[1]*Hprimey->get(i,j) +
+                     Ef.M[2]*Hprimez->get(i,j);
+        double E_i = (Hcurr->d[i] + 
+                      Ef.M[0]*Hprimex->d[i] + 
+                      Ef.M[1]*Hprimex->d[i] +
+                      Ef.M[2]*Hprimex->d[i]
                      ).real();
-        double E_j = (Hcurr->M[j*num_states+j] +
-                      Ef.M[0]*Hprimex->M[j*num_states+j] +
-                      Ef.M[1]*Hprimex->M[j*num_states+j] +
-                      Ef.M[2]*Hprimex->M[j*num_states+j]
+        double E_j = (Hcurr->d[j] +
+                      Ef.M[0]*Hprimex->d[j] +
+                      Ef.M[1]*Hprimex->d[j] +
+                      Ef.M[2]*Hprimex->d[j]
                      ).real();
 
 
-        double g_ij= (2.0*dt/(a_ii*hbar))*(A->M[i*num_states+j] * Hij ).imag(); // g_ij = P(i->j)
+        double g_ij= (2.0*dt/(a_ii*hbar))*(coherence(i,j) * Hij ).imag(); // g_ij = P(i->j)
 
         if(g_ij<0.0){ g_ij = 0.0; }
 //        if(boltz_flag==1){ 
@@ -172,90 +259,190 @@ void ElectronicStructure::init_hop_prob1(){
 void ElectronicStructure::update_hop_prob_fssh(double dt,int boltz_flag, double Temp,matrix& Ef,double Eex, matrix& rates){
 /*******************************************************
  Here we actually sum up all the transition probabilities
+ Only the row of the current state is needed by hop(), so 
+ by default only this row is computed (unless hop_all_rows==1).
+ Everything is computed in place from Ccurr, Hcurr and Hprime*,
+ without forming Heff or the density matrix A. The field terms
+ are only added when the field is non-zero. Boltzmann factors
+ are taken from the table.
 *******************************************************/
-  update_populations();
+  int n = num_states;
+  int is_field = (Ef.M[0]!=0.0 || Ef.M[1]!=0.0 || Ef.M[2]!=0.0);
+  update_boltz_factors(&Ef,Eex,Temp);
 
-  // Compute effective Hamiltonian
-  matrix* Heff; Heff = new matrix(num_states,num_states);
-  *Heff = *Hcurr + ( Ef.M[0] * (*Hprimex) + Ef.M[1] * (*Hprimey) + Ef.M[2] * (*Hprimez));
+  int i_min = curr_state;  int i_max = curr_state+1;
+  if(hop_all_rows){ i_min = 0; i_max = n; }
 
-
-  for(int i=0;i<num_states;i++){
-    double a_ii = A->M[i*num_states+i].real();
+  for(int i=i_min;i<i_max;i++){
+    complex<double> c_i = conj(Ccurr->M[i]);
+    double a_ii = (c_i*Ccurr->M[i]).real();
     if (a_ii==0.0){ a_ii = 1e-12; }
 
+    double* bf_i = boltz_factors(i);
+
+    double pref = 2.0*dt/(a_ii*hbar);
     double sum = 0.0;
-    for(int j=0;j<num_states;j++){
+    for(int j=0;j<n;j++){
       if(j!=i){
         // In general the expression is:
         // Pij = (2*dt/(hbar*|c_i|^2) ) * summ_j ( Im(Hij * c_j^* * c_j)  )
         // where Hij is for TD-SE: i*hbar*dc/dt = H * c
         // Hcurr at this moments is -i*hbar*<i|d/dt|j>
         // Hprime* at this moment is -i*hbar*<i|p|j>, Ef will include: 2*e/m_e * A(t) * cos(omega*t)
+        complex<double> Hij = Hcurr->get(i,j);
+        if(is_field){
+          Hij = Hcurr->get(i,j) + (Ef.M[0]*Hprimex->get(i,j) + Ef.M[1]*Hprimey->get(i,j) + Ef.M[2]*Hprimez->get(i,j));
+        }
 
-        g[i*num_states+j] = (2.0*dt/(a_ii*hbar))*(A->M[i*num_states+j] * Heff->M[i*num_states+j]).imag(); // g_ij = P(i->j)
-
-        if(g[i*num_states+j]<0.0){ g[i*num_states+j] = 0.0; }
+        double g_ij = pref*((c_i*Ccurr->M[j]) * Hij).imag(); // g_ij = P(i->j)
 
-       //------------------- Boltzmann factor -------------------
-       double E_i = Heff->M[i*num_states+i].real();
-       double E_j = Heff->M[j*num_states+j].real();
-       double dE = (E_j - E_i);
-       double bf = 1.0;
-       if(dE>Eex){  bf= exp(-((dE-Eex)/(kb*Temp))); }  // hop to higher energy state is difficult - thermal equilibrium
-                                                       // no such scaling for Hij_field - it is non-equilibrium process
+        if(g_ij<0.0){ g_ij = 0.0; }
 
-       //------------------- Together ---------------------------      
-        g[i*num_states+j] *= bf;
+       //------------------- Together with Boltzmann factor -----
+        g[i*n+j] = g_ij * bf_i[j];
 
-        sum += g[i*num_states+j];
+        sum += g[i*n+j];
       }// j!=i
     }// for j
-    g[i*num_states+i] -= sum;
+    g[i*n+i] -= sum;
   }// for i
 
+}
+
+
+
+void ElectronicStructure::update_hop_prob_fssh(double dt,double Temp,matrix& Ef,double Eex,TrajectoryBatch& b){
+/*******************************************************
+ Same as update_hop_prob_fssh above, for all trajectories
+ of the batch: row curr_state[k] of the hopping matrix of
+ trajectory k is accumulated in b.g
+*******************************************************/
+  int n = num_states;
+  int K = b.size;
+  int is_field = (Ef.M[0]!=0.0 || Ef.M[1]!=0.0 || Ef.M[2]!=0.0);
+  update_boltz_factors(&Ef,Eex,Temp);
+
+  for(int k=0;k<K;k++){
+    int i = b.curr_state[k];
+    complex<double> c_i = conj(complex<double>(b.re[i*K+k],b.im[i*K+k]));
+    double a_ii = (c_i*complex<double>(b.re[i*K+k],b.im[i*K+k])).real();
+    if (a_ii==0.0){ a_ii = 1e-12; }
+
+    double* bf_i = boltz_factors(i);
+    double* g_k = &b.g[k*n];
+
+    double pref = 2.0*dt/(a_ii*hbar);
+    double sum = 0.0;
+    for(int j=0;j<n;j++){
+      if(j!=i){
+        complex<double> Hij = Hcurr->get(i,j);
+        if(is_field){
+          Hij = Hcurr->get(i,j) + (Ef.M[0]*Hprimex->get(i,j) + Ef.M[1]*Hprimey->get(i,j) + Ef.M[2]*Hprimez->get(i,j));
+        }
+
+        double g_ij = pref*((c_i*complex<double>(b.re[j*K+k],b.im[j*K+k])) * Hij).imag(); // g_ij = P(i->j)
+
+        if(g_ij<0.0){ g_ij = 0.0; }
+
+        g_k[j] = g_ij * bf_i[j];
+
+        sum += g_k[j];
+      }// j!=i
+    }// for j
+    g_k[i] -= sum;
+  }// for k
 
-  delete Heff;
 }
 
 
+void ElectronicStructure::update_boltz_factors(matrix* Ef,double Eex,double Temp){
+/*******************************************************
+ Boltzmann factors for all i->j hops: bf[i*num_states+j]
+ The energies of the states (diagonal of Heff) normally change
+ only once per nuclear step, so the table is invalidated only if
+ the energies, Eex or Temp differ from those it was built for.
+ Rows are then computed on demand by boltz_factors(i).
+ Ef = NULL means no field.
+*******************************************************/
+  int n = num_states;
+  int is_field = 0;
+  if(Ef!=NULL){ is_field = (Ef->M[0]!=0.0 || Ef->M[1]!=0.0 || Ef->M[2]!=0.0); }
+  int is_same = (bf.size()==n*n && bf_Eex==Eex && bf_Temp==Temp);
+
+  if((int)bf_E.size()!=n){ bf_E = vector<double>(n,0.0); is_same = 0; }
+  for(int i=0;i<n;i++){
+    double E_i = Hcurr->d[i];
+    if(is_field){
+      E_i = (Hcurr->d[i] + (Ef->M[0]*Hprimex->d[i] + Ef->M[1]*Hprimey->d[i] + Ef->M[2]*Hprimez->d[i])).real();
+    }
+    if(E_i!=bf_E[i]){ bf_E[i] = E_i; is_same = 0; }
+  }
+  if(is_same){ return; }
+
+  if(bf.size()!=n*n){ bf = vector<double>(n*n,1.0); }
+  bf_row = vector<int>(n,0);
+  bf_Eex = Eex;
+  bf_Temp = Temp;
+}
+
+double* ElectronicStructure::boltz_factors(int i){
+// Row i of the Boltzmann factors table, computed if it is not up to date
+  int n = num_states;
+  if(!bf_row[i]){
+    for(int j=0;j<n;j++){
+      double dE = (bf_E[j] - bf_E[i]);
+      double bf_ij = 1.0;
+      if(dE>bf_Eex){  bf_ij = exp(-((dE-bf_Eex)/(kb*bf_Temp))); }  // hop to higher energy state is difficult - thermal equilibrium
+                                                                  // no such scaling for Hij_field - it is non-equilibrium process
+      bf[i*n+j] = bf_ij;
+    }// for j
+    bf_row[i] = 1;
+  }
+  return &bf[i*n];
+}
+
+void ElectronicStructure::precompute_boltz_factors(double Temp){
+/*******************************************************
+ Fills the whole table for zero field. Since the timeline is reused
+ by all trajectories, this needs to be done only once per nuclear step.
+ Afterwards the kernels only read the table, as long as Hcurr is not
+ changed (integrators 10 and 11 do change it)
+*******************************************************/
+  update_boltz_factors(NULL,0.0,Temp);
+  for(int i=0;i<num_states;i++){ boltz_factors(i); }
+}
+
 
 void ElectronicStructure::update_hop_prob_mssh(double dt,int boltz_flag, double Temp,matrix& Ef,double Eex, matrix& rates){
 /*******************************************************
   Here we actually sum up all the transition probabilities
+  Populations are taken directly from Ccurr, Boltzmann factors
+  from the table, so nothing is allocated here
 *******************************************************/
-  update_populations();
+  int n = num_states;
+  update_boltz_factors(&Ef,Eex,Temp);
 
-  matrix* Heff; Heff = new matrix(num_states,num_states);
-  *Heff = *Hcurr + ( Ef.M[0] * (*Hprimex) + Ef.M[1] * (*Hprimey) + Ef.M[2] * (*Hprimez));
+  int i_min = curr_state;  int i_max = curr_state+1;
+  if(hop_all_rows){ i_min = 0; i_max = n; }
 
-  for(int i=0;i<num_states;i++){
+  for(int i=i_min;i<i_max;i++){
+    double* bf_i = boltz_factors(i);
     double sum = 0.0;
-    for(int j=0;j<num_states;j++){
+    for(int j=0;j<n;j++){
       if(j!=i){
-        g[i*num_states+j] = A->M[j*num_states+j].real(); // g_ij = P(i->j)
-
-        if(g[i*num_states+j]<0.0){ g[i*num_states+j] = 0.0; }
+        double g_ij = (conj(Ccurr->M[j])*Ccurr->M[j]).real(); // g_ij = P(i->j)
 
-       //------------------- Boltzmann factor -------------------
-       double E_i = Heff->M[i*num_states+i].real();
-       double E_j = Heff->M[j*num_states+j].real();
-       double dE = (E_j - E_i);
-       double bf = 1.0;
-       if(dE>Eex){  bf= exp(-((dE-Eex)/(kb*Temp))); }  // hop to higher energy state is difficult - thermal equilibrium
-                                                       // no such scaling for Hij_field - it is non-equilibrium process
+        if(g_ij<0.0){ g_ij = 0.0; }
 
-       //------------------- Together ---------------------------
-        g[i*num_states+j] *= bf;
+       //------------------- Together with Boltzmann factor -----
+        g[i*n+j] = g_ij * bf_i[j];
 
-        sum += g[i*num_states+j];
+        sum += g[i*n+j];
       }// j!=i
     }// for j
-    g[i*num_states+i] -= sum;
+    g[i*n+i] -= sum;
   }// for i
 
-  delete Heff;
-
 }
 
        
@@ -264,88 +451,70 @@ void ElectronicStructure::update_hop_prob_mssh(double dt,int boltz_flag, double
 void ElectronicStructure::update_hop_prob_gfsh(double dt,int boltz_flag, double Temp,matrix& Ef,double Eex, matrix& rates){
 /*******************************************************
  Here we actually sum up all the transition probabilities
+ The rate of population change is computed directly as
+ a_dot_i = 2*Re(c_i^* * c_dot_i), c_dot = -i * Heff * C,
+ without forming Heff, C_dot or A_dot matrices
 *******************************************************/
   int i,j;
-  update_populations();
-
-  complex<double> one(0.0,1.0);
-
-  // Compute effective Hamiltonian
-  matrix* Heff; Heff = new matrix(num_states,num_states);
-  matrix* C_dot; C_dot = new matrix(num_states,1);
-  *Heff = *Hcurr + ( Ef.M[0] * (*Hprimex) + Ef.M[1] * (*Hprimey) + Ef.M[2] * (*Hprimez));
+  int n = num_states;
+  int is_field = (Ef.M[0]!=0.0 || Ef.M[1]!=0.0 || Ef.M[2]!=0.0);
+  update_boltz_factors(&Ef,Eex,Temp);
 
-//  exit(0);
-  *C_dot = -one * (*Heff * *Ccurr);  // assume hbar = 1
-
-  matrix* A_dot; A_dot = new matrix(num_states,num_states);
-  *A_dot = (*C_dot).conj() * (*Ccurr).T() + (*Ccurr).conj() * (*C_dot).T();  // this should be real matrix
-
-//  exit(0);
-
-  vector<double> a_dot(num_states,0.0);
-  vector<double> a(num_states,0.0);
+  if((int)pop.size()!=n){ pop = vector<double>(n,0.0); pop_dot = vector<double>(n,0.0); }
   double norm = 0.0;
 
-  for(i=0;i<num_states;i++){  
-    a_dot[i] = A_dot->M[i*num_states+i].real();
-    if(a_dot[i]<0.0){ norm += a_dot[i]; }
+  for(i=0;i<n;i++){
+    complex<double> HC(0.0,0.0);  // (Heff * C)_i
+    for(j=0;j<n;j++){
+      complex<double> Hij = Hcurr->get(i,j);
+      if(is_field){
+        Hij += (Ef.M[0]*Hprimex->get(i,j) + Ef.M[1]*Hprimey->get(i,j) + Ef.M[2]*Hprimez->get(i,j));
+      }
+      HC += Hij * Ccurr->M[j];
+    }
+    // c_dot_i = -i * HC, assume hbar = 1
+    complex<double> c_dot_i(HC.imag(),-HC.real());
 
-    a[i] = A->M[i*num_states+i].real();
+    pop_dot[i] = 2.0*(conj(Ccurr->M[i])*c_dot_i).real();
+    if(pop_dot[i]<0.0){ norm += pop_dot[i]; }
+
+    pop[i] = (conj(Ccurr->M[i])*Ccurr->M[i]).real();
   }
-  
+
+  int i_min = curr_state;  int i_max = curr_state+1;
+  if(hop_all_rows){ i_min = 0; i_max = n; }
 
   // Now calculate the hopping probabilities
-  for(i=0;i<num_states;i++){       
+  for(i=i_min;i<i_max;i++){       
+    double* bf_i = boltz_factors(i);
     double sumg = 0.0;
 
-    for(j=0;j<num_states;j++){
+    for(j=0;j<n;j++){
  
       if(j!=i){  // off-diagonal = probabilities to hop to other states
 
         //--------------------- Surface hopping algorithms probabilities --------------
-        if(a[i]<1e-12){  g[i*num_states+j] = 0.0; }  // since the initial population is almost zero, so no need for hops
-        else{
-          g[i*num_states+j] = dt*(a_dot[j]/a[i]) * a_dot[i] / norm;  
-                                              
-          if(g[i*num_states+j]<0.0){  // since norm is negative, than this condition means that a_dot[i] and a_dot[j] have same signs
-                                      // which is bad - so no transitions are assigned
-            g[i*num_states+j] = 0.0;
-          }
-          else{  // here we have opposite signs of a_dot[i] and a_dot[j], but this is not enough yet
-            if(a_dot[i]<0.0 & a_dot[j]>0.0){ ;; } // this is out transition probability, but it is already computed
-              else{  g[i*num_states+j] = 0.0; } // wrong transition
-          }
+        double g_ij = 0.0;
+        if(pop[i]>=1e-12){  // if the initial population is almost zero, there is no need for hops
+          g_ij = dt*(pop_dot[j]/pop[i]) * pop_dot[i] / norm;  
+
+          // since norm is negative, g_ij<0 means that a_dot[i] and a_dot[j] have same signs
+          // which is bad - so no transitions are assigned
+          // opposite signs are not enough yet: only out transitions are allowed
+          if(g_ij<0.0){ g_ij = 0.0; }
+          else if(!(pop_dot[i]<0.0 && pop_dot[j]>0.0)){ g_ij = 0.0; }
         }// a[i]>1e-12
 
+       //------------------- Together with Boltzmann factor -----
+        g[i*n+j] = g_ij * bf_i[j];
 
-
-       //------------------- Boltzmann factor -------------------
-        double E_i = Heff->M[i*num_states+i].real();
-        double E_j = Heff->M[j*num_states+j].real();
-
-        // Boltzmann factor correction
-        double dE = (E_j - E_i);
-        double bf = 1.0;
-        if(dE>Eex){  bf= exp(-((dE-Eex)/(kb*Temp))); }  // hop to higher energy state is difficult - thermal equilibrium
-                                                        // no such scaling for Hij_field - it is non-equilibrium process
-
-       //------------------- Together ---------------------------       
-        g[i*num_states+j] *= bf;
-
-
-        sumg += g[i*num_states+j];
+        sumg += g[i*n+j];
       }
     }// for j
 
-    g[i*num_states+i] -= sumg;  // probability to stay in state i
+    g[i*n+i] -= sumg;  // probability to stay in state i
   }// for i
 
-
-  delete Heff;
-  delete A_dot;
-  delete C_dot;
-
 }
 
 
@@ -438,36 +607,125 @@ void ElectronicStructure::propagate_coefficients(double dt,matrix& Ef){
   // exp(iLij * dt/2)  ---->
   for(i=0;i<num_states;i++){
     for(j=i+1;j<num_states;j++){
-      Hprime = Ef.M[0]*Hprimex->M[i*num_states+j] +
-               Ef.M[1]*Hprimey->M[i*num_states+j] +
-               Ef.M[2]*Hprimez->M[i*num_states+j];
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
 
-      rot(Hcurr->M[i*num_states+j]+Hprime,0.5*dt,i,j);
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j);
     }
   }
 
   // exp(iL1 * dt)
   for(i=0;i<num_states;i++){ 
-    Hprime = Ef.M[0]*Hprimex->M[i*num_states+i] +
-             Ef.M[1]*Hprimey->M[i*num_states+i] +
-             Ef.M[2]*Hprimez->M[i*num_states+i];
+    Hprime = Ef.M[0]*Hprimex->d[i] +
+             Ef.M[1]*Hprimey->d[i] +
+             Ef.M[2]*Hprimez->d[i];
 
-    phase(Hcurr->M[i*num_states+i]+Hprime,dt,i); 
+    phase(Hcurr->d[i]+Hprime,dt,i); 
   }
 
   // exp(iLij * dt/2)  <----
   for(i=num_states-1;i>=0;i--){
     for(j=num_states-1;j>i;j--){
-      Hprime = Ef.M[0]*Hprimex->M[i*num_states+j] +
-               Ef.M[1]*Hprimey->M[i*num_states+j] +
-               Ef.M[2]*Hprimez->M[i*num_states+j];
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
 
-      rot(Hcurr->M[i*num_states+j]+Hprime,0.5*dt,i,j);
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j);
     }
   }
   
 }
 
+void ElectronicStructure::rot(complex<double> Hij,double dt,int i,int j,TrajectoryBatch& b){
+/***********************************************************************
+  Same as rot(Hij,dt,i,j), for all trajectories of the batch at once:
+  rot1 * rot2 * rot1 with the angles that only depend on Hij, applied
+  to the real and imaginary parts explicitly
+***********************************************************************/
+  double phi1 = 0.5*dt*Hij.imag()/hbar;
+  double phi2 = -dt*Hij.real()/hbar;
+  double c1 = cos(phi1), s1 = sin(phi1);
+  double c2 = cos(phi2), s2 = sin(phi2);
+
+  int K = b.size;
+  double* xr = &b.re[i*K];  double* xi = &b.im[i*K];
+  double* yr = &b.re[j*K];  double* yi = &b.im[j*K];
+
+  #pragma omp simd
+  for(int k=0;k<K;k++){
+    // rot1
+    double ar =  c1*xr[k] + s1*yr[k],   ai =  c1*xi[k] + s1*yi[k];
+    double br = -s1*xr[k] + c1*yr[k],   bi = -s1*xi[k] + c1*yi[k];
+    // rot2
+    double cr = c2*ar - s2*bi,   ci = c2*ai + s2*br;
+    double dr = c2*br - s2*ai,   di = c2*bi + s2*ar;
+    // rot1
+    xr[k] =  c1*cr + s1*dr;   xi[k] =  c1*ci + s1*di;
+    yr[k] = -s1*cr + c1*dr;   yi[k] = -s1*ci + c1*di;
+  }
+}
+
+void ElectronicStructure::phase(complex<double> Hii,double dt,int i,TrajectoryBatch& b){
+// Same as phase(Hii,dt,i), for all trajectories of the batch
+  double phi = -dt*Hii.real()/hbar;
+  double c = cos(phi), s = sin(phi);
+
+  int K = b.size;
+  double* xr = &b.re[i*K];  double* xi = &b.im[i*K];
+
+  #pragma omp simd
+  for(int k=0;k<K;k++){
+    double r = c*xr[k] - s*xi[k];
+    xi[k] = c*xi[k] + s*xr[k];
+    xr[k] = r;
+  }
+}
+
+void ElectronicStructure::propagate_coefficients(double dt,matrix& Ef,TrajectoryBatch& b){
+// Same as propagate_coefficients(dt,Ef), for the coefficients of all trajectories of b.
+// Ccurr is not used
+
+  int i,j;
+  complex<double> Hprime;
+
+  // exp(iLij * dt/2)  ---->
+  for(i=0;i<num_states;i++){
+    for(j=i+1;j<num_states;j++){
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
+
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j,b);
+    }
+  }
+
+  // exp(iL1 * dt)
+  for(i=0;i<num_states;i++){ 
+    Hprime = Ef.M[0]*Hprimex->d[i] +
+             Ef.M[1]*Hprimey->d[i] +
+             Ef.M[2]*Hprimez->d[i];
+
+    phase(Hcurr->d[i]+Hprime,dt,i,b); 
+  }
+
+  // exp(iLij * dt/2)  <----
+  for(i=num_states-1;i>=0;i--){
+    for(j=num_states-1;j>i;j--){
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
+
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j,b);
+    }
+  }
+
+}
+
 void ElectronicStructure::propagate_coefficients(double dt,matrix& Ef,matrix& rates){
 
   int i,j;
@@ -478,38 +736,36 @@ void ElectronicStructure::propagate_coefficients(double dt,matrix& Ef,matrix& ra
   // exp(iLij * dt/2)  ---->
   for(i=0;i<num_states;i++){
     for(j=i+1;j<num_states;j++){
-      Hprime = Ef.M[0]*Hprimex->M[i*num_states+j] +
-               Ef.M[1]*Hprimey->M[i*num_states+j] +
-               Ef.M[2]*Hprimez->M[i*num_states+j];
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
 
-      rot(Hcurr->M[i*num_states+j]+Hprime,0.5*dt,i,j);
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j);
     }
   }
 
   update_populations();
+  update_decoherence_times(rates);
 
   // exp(iL1 * dt)
   for(i=0;i<num_states;i++){
-    Hprime = Ef.M[0]*Hprimex->M[i*num_states+i] +
-             Ef.M[1]*Hprimey->M[i*num_states+i] +
-             Ef.M[2]*Hprimez->M[i*num_states+i];
-
-    tau_m[i] = 0.0;
-    for(j=0;j<num_states;j++){
-      tau_m[i] += A->M[j*num_states+j].real()*rates.M[i*num_states+j].real();
-    }// for j
+    Hprime = Ef.M[0]*Hprimex->d[i] +
+             Ef.M[1]*Hprimey->d[i] +
+             Ef.M[2]*Hprimez->d[i];
 
-    phase(Hcurr->M[i*num_states+i]+Hprime+4.0*tau_m[i]*hbar,dt,i);
+    phase(Hcurr->d[i]+Hprime+4.0*tau_m[i]*hbar,dt,i);
   }
 
   // exp(iLij * dt/2)  <----
   for(i=num_states-1;i>=0;i--){
     for(j=num_states-1;j>i;j--){
-      Hprime = Ef.M[0]*Hprimex->M[i*num_states+j] +
-               Ef.M[1]*Hprimey->M[i*num_states+j] +
-               Ef.M[2]*Hprimez->M[i*num_states+j];
+      int ij = Hcurr->upper(i,j);
+      Hprime = Ef.M[0]*Hprimex->u[ij] +
+               Ef.M[1]*Hprimey->u[ij] +
+               Ef.M[2]*Hprimez->u[ij];
 
-      rot(Hcurr->M[i*num_states+j]+Hprime,0.5*dt,i,j);
+      rot(Hcurr->u[ij]+Hprime,0.5*dt,i,j);
     }
   }
 
@@ -525,9 +781,11 @@ void ElectronicStructure::propagate_coefficients1(double dt,int opt,matrix& Ef){
 ***********************************************************************/
 
   complex<double> i(0.0,1.0);
-  *Hcurr = *Hcurr + dt*(*dHdt);
-  if(opt==1){  *Cnext = *Ccurr - (i*dt/hbar)*(*Hcurr) * (*Ccurr);      }
-  else if(opt==2){ *Cnext = *Cprev - 2.0*(i*dt/hbar)*(*Hcurr) * (*Ccurr); }
+  axpy(dt,*dHdt,*Hcurr);
+  matrix H(num_states,num_states);  Hcurr->unpack(H);
+  matrix HC(H * (*Ccurr));
+  if(opt==1){  *Cnext = *Ccurr; axpy(-(i*dt/hbar),HC,*Cnext);     }
+  else if(opt==2){ *Cnext = *Cprev; axpy(-2.0*(i*dt/hbar),HC,*Cnext); }
 
   *Cprev = *Ccurr;
   *Ccurr = *Cnext;
@@ -545,12 +803,43 @@ void ElectronicStructure::propagate_coefficients2(double dt,matrix& Ef){
   double tol = 1e-12;
   complex<double> arg(0.0,(-dt/hbar));
 
-  // hermitian symmetrize Hcurr - just to be sure the algorithm will work better
-  matrix tmp(Hcurr->n_rows,Hcurr->n_cols);
-  tmp = ((*Hcurr) + (*Hcurr).H());
-  tmp *= 0.5;
+  // Hcurr is stored as Hermitian, so the full matrix is Hermitian by construction
+  matrix tmp(num_states,num_states);
+  Hcurr->unpack(tmp);
 
   *Ccurr = exp(tmp,arg,tol) * (*Ccurr);
 }
 
+void ElectronicStructure::propagate_coefficients4(double t,double dt){
+/*************************************************************
+  4-th order Magnus propagator for i*hbar*dC/dt = H(t) * C
+  The Hamiltonian is interpolated linearly within the nuclear step:
+  H(t) = Hcurr + t * dHdt, where t is the time since the beginning
+  of the nuclear step. With H1 and H2 taken at the Gauss points 
+  t + (1/2 -+ sqrt(3)/6)*dt:
+  C(t+dt) = exp(-i*dt*Heff/hbar) * C(t)
+  Heff = (H1 + H2)/2 - i*(sqrt(3)*dt/(12*hbar)) * [H2,H1]
+  Heff is Hermitian, so the matrix exponent is computed as in 
+  propagate_coefficients2. Hcurr is not modified.
+  No field coupling: integrator 4 with field is rejected in
+  InputStructure::sanity_check
+*************************************************************/
+  double tol = 1e-12;
+  double c1 = 0.5 - sqrt(3.0)/6.0;
+  double c2 = 0.5 + sqrt(3.0)/6.0;
+  complex<double> arg(0.0,(-dt/hbar));
+  complex<double> pref(0.0,-sqrt(3.0)*dt/(12.0*hbar));
+
+  hermitian_matrix h(*Hcurr);
+  matrix H1(num_states,num_states);  axpy(t + c1*dt,*dHdt,h);  h.unpack(H1);
+  h = *Hcurr;
+  matrix H2(num_states,num_states);  axpy(t + c2*dt,*dHdt,h);  h.unpack(H2);
+
+  matrix Heff(H1);  Heff += H2;  Heff *= 0.5;
+  matrix Comm(H2*H1);  Comm -= H1*H2;
+  axpy(pref,Comm,Heff);
+
+  *Ccurr = exp(Heff,arg,tol) * (*Ccurr);
+}
+
 
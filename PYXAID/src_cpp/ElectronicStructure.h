@@ -20,6 +20,56 @@ using namespace std;
 
 
 
+class TrajectoryBatch{
+/*****************************************************************
+ Coefficients of K trajectories that share the same Hamiltonian,
+ stored as structure of arrays: re[i*K+k], im[i*K+k] is c_i of
+ trajectory k. A Trotter rotation in the (i,j) plane has the same
+ angles for all trajectories, so it becomes one vectorized loop 
+ over k, see ElectronicStructure::propagate_coefficients
+*****************************************************************/
+public:
+  int num_states;              // number of adiabatic states
+  int size;                    // number of trajectories, K
+  vector<double> re, im;       // coefficients
+  vector<int> curr_state;      // current state of each trajectory
+  vector<double> g;            // g[k*num_states+j] - probability of curr_state[k] -> j hop of trajectory k
+
+  TrajectoryBatch(int n,int K){
+    num_states = n;  size = K;
+    re = vector<double>(n*K,0.0);  im = vector<double>(n*K,0.0);
+    curr_state = vector<int>(K,0);
+    g = vector<double>(n*K,0.0);
+  }
+
+  void set(int k,matrix& C,int state){
+    for(int i=0;i<num_states;i++){ re[i*size+k] = C.M[i].real(); im[i*size+k] = C.M[i].imag(); }
+    curr_state[k] = state;
+  }
+  void get(int k,matrix& C){
+    for(int i=0;i<num_states;i++){ C.M[i] = complex<double>(re[i*size+k],im[i*size+k]); }
+  }
+  void init_hop_prob(){  // same as ElectronicStructure::init_hop_prob1, for the current states
+    for(int k=0;k<size;k++){
+      for(int j=0;j<num_states;j++){ g[k*num_states+j] = (j==curr_state[k])? 1.0 : 0.0; }
+    }
+  }
+};
+
+struct adaptive_step_data{
+// Adaptive electronic time step of one nuclear step, see adaptive_elec_steps in namd.cpp
+  int nel;            // number of electronic steps chosen the last time (0 - not chosen yet)
+  long calls;         // number of times the step was chosen (once per trajectory)
+  long elec;          // total number of electronic steps
+  long refine;        // number of times the step had to be halved
+  long unconverged;   // number of times elec_dt_tol was not reached with the smallest step
+  int nmin,nmax;      // smallest and largest number of electronic steps
+
+  adaptive_step_data(){ reset(); }
+  void reset(){ nel = 0; calls = elec = refine = unconverged = 0; nmin = nmax = 0; }
+};
+
+
 class ElectronicStructure{
 
   // For DISH
@@ -32,6 +82,27 @@ class ElectronicStructure{
   void rot2(double phi,int i,int j);
   void rot(complex<double> Hij,double dt,int i,int j);
   void phase(complex<double> Hii,double dt,int i);
+  void rot(complex<double> Hij,double dt,int i,int j,TrajectoryBatch& b);
+  void phase(complex<double> Hii,double dt,int i,TrajectoryBatch& b);
+
+  // Boltzmann factors for hops, see update_boltz_factors
+  vector<double> bf;    // bf[i*num_states+j] - factor for i->j hop
+  vector<int> bf_row;   // bf_row[i] = 1 if row i of bf is up to date
+  vector<double> bf_E;  // state energies the table was computed for
+  double bf_Eex, bf_Temp;
+  void update_boltz_factors(matrix* Ef,double Eex,double Temp);
+  double* boltz_factors(int i);
+
+  // Work arrays for GFSH and DISH
+  vector<double> pop, pop_dot;
+
+  // DISH with the rates reused between steps, see check_decoherence_events
+  vector<double> dish_p;                  // populations the rates tau_m were computed with
+  int dish_repredict;                     // 1 - the rates are recomputed on the next step (after an event)
+
+  // Coefficients that define the density matrix A, see update_populations
+  vector< complex<double> > C_A;
+  int is_A;  // 1 if A is built from C_A
 
 public:
 
@@ -43,23 +114,25 @@ public:
   matrix* Ccurr;
   matrix* Cprev;
   matrix* Cnext;
-  matrix* A;                      // density matrix - populations and coherences
+  matrix* A;                      // density matrix - populations and coherences, use density_matrix()
 
-  // Hamiltonian: meaning of "current" and "next" depends on the algorithm to solve TD-SE
-  matrix* Hcurr; // current Hamiltonian                             Hij = H[i*num_states+j]
-  matrix* Hprev; // Hamiltonian on previous nuclear time step                 ---
-  matrix* Hnext; // Hamiltonian on next nuclear time step                     ---
-  matrix* dHdt;  // slope of Hamiltonian - for interpolation scheme           ---
+  // Hamiltonian: Hermitian, so only the diagonal and the upper triangle are stored
+  hermitian_matrix* Hcurr; // current Hamiltonian                   Hij = Hcurr->get(i,j)
+  hermitian_matrix* dHdt;  // slope of Hamiltonian - for interpolation scheme           ---
 
-  matrix* Hprimex;
-  matrix* Hprimey;
-  matrix* Hprimez;
+  hermitian_matrix* Hprimex;
+  hermitian_matrix* Hprimey;
+  hermitian_matrix* Hprimez;
 
   vector<double> g; // num_states x num_states matrix, reshaped in 1D array
+  int hop_all_rows; // 1 - compute hopping probabilities for all states, 0 - only for curr_state (FSSH)
 
   // DISH variables:
   vector<double> tau_m; // times since last decoherence even for all PES (actually rates, that is inverse times)
   vector<double> t_m;   // time counters for each PES
+
+  // Adaptive electronic time step
+  adaptive_step_data adapt;
   
 
 
@@ -75,21 +148,24 @@ public:
     Cnext = new matrix(n,1); *Cnext = tmp;
 
     g = std::vector<double>(n*n,0.0);  // g[i*n+j] ~=g[i][j] - probability of i->j transition
+    hop_all_rows = 0;
 
     A = new matrix(n,n); *A = tmp;
+    C_A = vector< complex<double> >(n,tmp);  is_A = 1;
 
-    Hcurr = new matrix(n,n); *Hcurr = tmp;
-    Hprev = new matrix(n,n); *Hprev = tmp;
-    Hnext = new matrix(n,n); *Hnext = tmp;
-    dHdt  = new matrix(n,n); *dHdt  = tmp;
+    Hcurr = new hermitian_matrix(n);
+    dHdt  = new hermitian_matrix(n);
 
-    Hprimex = new matrix(n,n); *Hprimex = tmp;
-    Hprimey = new matrix(n,n); *Hprimey = tmp;
-    Hprimez = new matrix(n,n); *Hprimez = tmp;
+    Hprimex = new hermitian_matrix(n);
+    Hprimey = new hermitian_matrix(n);
+    Hprimez = new hermitian_matrix(n);
 
 
     tau_m = std::vector<double>(n,0.0);
     t_m = std::vector<double>(n,0.0);
+
+    bf_Eex = bf_Temp = 0.0;
+    dish_repredict = 0;
   }
 
   ElectronicStructure(const ElectronicStructure& es){ // Copy constructor
@@ -104,25 +180,29 @@ public:
     Cnext = new matrix(n,1);
 
     g = std::vector<double>(n*n,0.0);  // g[i*n+j] ~=g[i][j] - probability of i->j transition
+    hop_all_rows = es.hop_all_rows;
     
     A = new matrix(n,n);
 
-    Hcurr = new matrix(n,n);
-    Hprev = new matrix(n,n);
-    Hnext = new matrix(n,n);
-    dHdt  = new matrix(n,n); 
+    Hcurr = new hermitian_matrix(n);
+    dHdt  = new hermitian_matrix(n);
 
-    Hprimex = new matrix(n,n);
-    Hprimey = new matrix(n,n);
-    Hprimez = new matrix(n,n);
+    Hprimex = new hermitian_matrix(n);
+    Hprimey = new hermitian_matrix(n);
+    Hprimez = new hermitian_matrix(n);
 
 
     tau_m = es.tau_m;
     t_m = es.t_m;
+    dish_p = es.dish_p;  dish_repredict = es.dish_repredict;
+    adapt = es.adapt;
+
+    C_A = es.C_A;  is_A = es.is_A;
+    bf = es.bf;  bf_row = es.bf_row;  bf_E = es.bf_E;  bf_Eex = es.bf_Eex;  bf_Temp = es.bf_Temp;
 
     *Ccurr = *es.Ccurr; *Cprev = *es.Cprev; *Cnext = *es.Cnext;
     g = es.g;  *A = *es.A;
-    *Hcurr = *es.Hcurr;  *Hprev = *es.Hprev;  *Hnext = *es.Hnext;  *dHdt  = *es.dHdt;
+    *Hcurr = *es.Hcurr;  *dHdt  = *es.dHdt;
     *Hprimex = *es.Hprimex; *Hprimey = *es.Hprimey; *Hprimez = *es.Hprimez;
   }
   // Destructor
@@ -134,8 +214,6 @@ public:
     if(Cnext!=NULL) {delete Cnext;}// Cnext = NULL;}
     if(A!=NULL) { delete A;} // A = NULL;}
     if(Hcurr!=NULL){ delete Hcurr;} // Hcurr = NULL;}
-    if(Hprev!=NULL){ delete Hprev;}// Hprev = NULL;}
-    if(Hnext!=NULL){ delete Hnext;}// Hnext = NULL;}
     if(dHdt!=NULL){ delete dHdt;} // dHdt = NULL;} 
     if(Hprimex!=NULL){ delete Hprimex; }
     if(Hprimey!=NULL){ delete Hprimey; }
@@ -149,15 +227,18 @@ public:
     num_states = es.num_states;
     curr_state = es.curr_state;
    *Ccurr = *es.Ccurr; *Cprev = *es.Cprev; *Cnext = *es.Cnext;
-    g = es.g;  *A = *es.A;
-    *Hcurr = *es.Hcurr;  *Hprev = *es.Hprev; *Hnext = *es.Hnext;
+    g = es.g;  *A = *es.A;  C_A = es.C_A;  is_A = es.is_A;  hop_all_rows = es.hop_all_rows;
+    *Hcurr = *es.Hcurr;
     *Hprimex = *es.Hprimex; *Hprimey = *es.Hprimey; *Hprimez = *es.Hprimez; 
     *dHdt  = *es.dHdt;
     tau_m = es.tau_m;  t_m = es.t_m;
+    dish_p = es.dish_p;  dish_repredict = es.dish_repredict;
+    bf = es.bf;  bf_row = es.bf_row;  bf_E = es.bf_E;  bf_Eex = es.bf_Eex;  bf_Temp = es.bf_Temp;
+    adapt = es.adapt;
     return *this;
   }
 
-  ElectronicStructure operator<<(ElectronicStructure es){
+  ElectronicStructure& operator<<(const ElectronicStructure& es){
 // This is basically the same as operator=, but keeps parameters the same
 // copied only wavefunction and state
 
@@ -170,6 +251,7 @@ public:
 // Also need to update the DISH timescales
    tau_m = es.tau_m;
    t_m = es.t_m;
+   dish_p = es.dish_p;  dish_repredict = es.dish_repredict;
 
     return *this;
   }
@@ -187,20 +269,29 @@ public:
   double norm(); // calculate the norm of the wavefunction
 
   void update_populations();      // update matrix A from Ccurr
+  double population(int i);       // A_ii
+  complex<double> coherence(int i,int j); // A_ij
+  matrix& density_matrix();       // full matrix A
   void update_hop_prob(double dt,int is_boltz_flag,double Temp,matrix& Ef);
 
 
   void update_hop_prob_fssh(double dt,int is_boltz_flag,double Temp,matrix& Ef,double Ex, matrix&);
   void update_hop_prob_mssh(double dt,int is_boltz_flag,double Temp,matrix& Ef,double Ex, matrix&);
   void update_hop_prob_gfsh(double dt,int is_boltz_flag,double Temp,matrix& Ef,double Ex, matrix&);
+  void update_hop_prob_fssh(double dt,double Temp,matrix& Ef,double Ex,TrajectoryBatch& b);
   void init_hop_prob1(); 
 
   void check_decoherence(double dt,int boltz_flag,double Temp,matrix& rates); // practically DISH correction
+  void check_decoherence_events(double dt,int boltz_flag,double Temp,matrix& rates,double tol); // same, rates updated on population change
+  void reset_decoherence_events(); // start of a new trajectory for check_decoherence_events
+  void precompute_boltz_factors(double Temp);  // Boltzmann factors for all pairs, no field
 
   void propagate_coefficients(double dt,matrix& Ef);  // Trotter factorization
   void propagate_coefficients(double dt,matrix& Ef,matrix&);  // Trotter factorization with purostat
+  void propagate_coefficients(double dt,matrix& Ef,TrajectoryBatch& b); // Trotter factorization, all trajectories of b
   void propagate_coefficients1(double dt,int opt,matrix& Ef); // Finite difference
   void propagate_coefficients2(double dt,matrix& Ef); // "Exact"
+  void propagate_coefficients4(double t,double dt); // 4-th order Magnus with interpolated H
 
 };
 
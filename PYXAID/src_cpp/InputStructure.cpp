@@ -26,9 +26,10 @@ void InputStructure::init(){
   // Variables are not defined
   is_read_couplings =
 //  is_many_electron_algorithm =
-  is_namdtime = is_sh_algo = is_num_sh_traj =
+  is_namdtime = is_sh_algo = is_num_sh_traj = is_sh_batch =
   is_boltz_flag = is_debug_flag = is_Temp =
   is_nucl_dt = is_elec_dt = is_integrator =
+  is_elec_dt_adaptive = is_elec_dt_tol = is_elec_dt_min = is_elec_dt_max =
   is_runtype = 
   is_Ham_re_prefix = is_Ham_re_suffix = 
   is_Ham_im_prefix = is_Ham_im_suffix =
@@ -39,7 +40,7 @@ void InputStructure::init(){
 //  is_nac_im_prefix = is_nac_im_suffix = 
   is_energy_in_one_file =
   is_scratch_dir = is_energy_units = is_alp_bet = is_decoherence = 
-  is_regress_mode = 
+  is_regress_mode = is_dish_events = is_dish_pop_tol = is_spectral_output = is_scaling_output = is_deco_rates_policy = is_deco_rates_cache =
   is_is_field = is_field_dir = is_field_protocol = is_field_Tm = 
   is_field_T = is_field_freq = is_field_freq_units = is_field_fluence = 0;
 
@@ -80,16 +81,27 @@ void InputStructure::echo(){
   if(is_namdtime){ cout<<"namdtime = "<<namdtime<<endl; }
   if(is_sh_algo){ cout<<"sh_algo = "<<sh_algo<<endl; }
   if(is_num_sh_traj){ cout<<"num_sh_traj = "<<num_sh_traj<<endl; }
+  if(is_sh_batch){ cout<<"sh_batch = "<<sh_batch<<endl; }
   if(is_boltz_flag){ cout<<"boltz_flag = "<<boltz_flag<<endl; }
   if(is_debug_flag){ cout<<"debug_flag = "<<debug_flag<<endl; }
   if(is_Temp){ cout<<"Temp [K] = "<<Temp<<endl; }
   if(is_elec_dt){ cout<<"elec_dt [fs] = "<<elec_dt<<endl; }
   if(is_nucl_dt){ cout<<"nucl_dt [fs] = "<<nucl_dt<<endl; }
+  if(is_elec_dt_adaptive){ cout<<"elec_dt_adaptive = "<<elec_dt_adaptive<<endl; }
+  if(is_elec_dt_tol){ cout<<"elec_dt_tol = "<<elec_dt_tol<<endl; }
+  if(is_elec_dt_min){ cout<<"elec_dt_min [fs] = "<<elec_dt_min<<endl; }
+  if(is_elec_dt_max){ cout<<"elec_dt_max [fs] = "<<elec_dt_max<<endl; }
   if(is_integrator){ cout<<"integrator = "<<integrator<<endl; }
   if(is_runtype){ cout<<"runtype = "<<runtype<<endl; }
   if(is_alp_bet){ cout<<"alp_bet = "<<alp_bet<<endl; }
   if(is_decoherence){ cout<<"decoherence = "<<decoherence<<endl; }
   if(is_regress_mode){ cout<<"regress_mode = "<<regress_mode<<endl; }
+  if(is_dish_events){ cout<<"dish_events = "<<dish_events<<endl; }
+  if(is_dish_pop_tol){ cout<<"dish_pop_tol = "<<dish_pop_tol<<endl; }
+  if(is_spectral_output){ cout<<"spectral_output = "<<spectral_output<<endl; }
+  if(is_scaling_output){ cout<<"scaling_output = "<<scaling_output<<endl; }
+  if(is_deco_rates_policy){ cout<<"deco_rates_policy = "<<deco_rates_policy<<endl; }
+  if(is_deco_rates_cache){ cout<<"deco_rates_cache = "<<deco_rates_cache<<endl; }
   if(is_is_field){ cout<<"is_field = "<<is_field<<endl; }
   if(is_field_dir){ cout<<"field_dir = "<<field_dir<<endl; }
   if(is_field_protocol){ cout<<"field_protocol = "<<field_protocol<<endl; }
@@ -138,16 +150,27 @@ void InputStructure::set_default(){
   if(!is_namdtime){ warning("namdtime","0"); namdtime = 0; is_namdtime = 1; wrn_status++; }
   if(!is_sh_algo){ warning("sh_algo","0"); sh_algo = 0; is_sh_algo = 1; wrn_status++; }
   if(!is_num_sh_traj){ warning("num_sh_traj","1"); num_sh_traj = 1; is_num_sh_traj = 1; wrn_status++; }
+  if(!is_sh_batch){ warning("sh_batch","0"); sh_batch = 0; is_sh_batch = 1; wrn_status++; }
   if(!is_boltz_flag){ warning("boltz_flag","1"); boltz_flag=1; is_boltz_flag = 1; wrn_status++; }
   if(!is_debug_flag){ warning("debug_flag","0"); debug_flag=0; is_debug_flag = 1; wrn_status++; }
   if(!is_Temp){ warning("Temp","300.0"); Temp = 300.0; is_Temp = 1; wrn_status++; }
   if(!is_nucl_dt){ warning("nucl_dt","1.0"); nucl_dt = 1.0; is_nucl_dt = 1; wrn_status++; }
   if(!is_elec_dt){ warning("elec_dt","0.001"); elec_dt = 0.001; is_elec_dt = 1; wrn_status++; }
   if(!is_integrator){ warning("integrator","0"); integrator = 0; is_integrator = 1; wrn_status++; }
+  if(!is_elec_dt_adaptive){ warning("elec_dt_adaptive","0"); elec_dt_adaptive = 0; is_elec_dt_adaptive = 1; wrn_status++; }
+  if(!is_elec_dt_tol){ warning("elec_dt_tol","1e-6"); elec_dt_tol = 1e-6; is_elec_dt_tol = 1; wrn_status++; }
+  if(!is_elec_dt_min){ warning("elec_dt_min","0.1*elec_dt"); elec_dt_min = 0.1*elec_dt; is_elec_dt_min = 1; wrn_status++; }
+  if(!is_elec_dt_max){ warning("elec_dt_max","nucl_dt"); elec_dt_max = nucl_dt; is_elec_dt_max = 1; wrn_status++; }
   if(!is_runtype){ warning("runtype","namd"); runtype = "namd"; is_runtype = 1; wrn_status++; }
   if(!is_alp_bet){ warning("alp_bet","0"); alp_bet = 0; is_alp_bet = 1; wrn_status++; }
   if(!is_decoherence){ warning("decoherence","0"); decoherence = 0; is_decoherence = 1; wrn_status++; }
   if(!is_regress_mode){ warning("regress_mode","0"); regress_mode = 0; is_regress_mode = 1; wrn_status++; }
+  if(!is_dish_events){ warning("dish_events","0"); dish_events = 0; is_dish_events = 1; wrn_status++; }
+  if(!is_dish_pop_tol){ warning("dish_pop_tol","0.01"); dish_pop_tol = 0.01; is_dish_pop_tol = 1; wrn_status++; }
+  if(!is_spectral_output){ warning("spectral_output","0"); spectral_output = 0; is_spectral_output = 1; wrn_status++; }
+  if(!is_scaling_output){ warning("scaling_output","0"); scaling_output = 0; is_scaling_output = 1; wrn_status++; }
+  if(!is_deco_rates_policy){ warning("deco_rates_policy","icond"); deco_rates_policy = "icond"; is_deco_rates_policy = 1; wrn_status++; }
+  if(!is_deco_rates_cache){ warning("deco_rates_cache","0"); deco_rates_cache = 0; is_deco_rates_cache = 1; wrn_status++; }
 
   if(!is_is_field){ warning("is_field","0"); is_field = 0; is_is_field = 1; wrn_status++; }
   if(!is_field_dir){ warning("field_dir","xyz"); field_dir = "xyz"; is_field_dir = 1; wrn_status++; }
@@ -208,17 +231,28 @@ InputStructure::InputStructure(boost::python::dict params){
     else if(s1=="namdtime"){ namdtime = extract<int>(params[s1]); is_namdtime = 1; }
     else if(s1=="sh_algo"){ sh_algo = extract<int>(params[s1]); is_sh_algo = 1; }
     else if(s1=="num_sh_traj"){ num_sh_traj = extract<int>(params[s1]); is_num_sh_traj = 1; }
+    else if(s1=="sh_batch"){ sh_batch = extract<int>(params[s1]); is_sh_batch = 1; }
     else if(s1=="boltz_flag"){ boltz_flag = extract<int>(params[s1]); is_boltz_flag = 1; }
     else if(s1=="debug_flag"){ debug_flag = extract<int>(params[s1]); is_debug_flag = 1; }
     else if(s1=="Temp"){ Temp = extract<double>(params[s1]); is_Temp = 1; }
     else if(s1=="nucl_dt"){ nucl_dt = extract<double>(params[s1]); is_nucl_dt = 1; }
     else if(s1=="elec_dt"){ elec_dt = extract<double>(params[s1]); is_elec_dt = 1; }
     else if(s1=="integrator"){ integrator = extract<int>(params[s1]); is_integrator = 1; }
+    else if(s1=="elec_dt_adaptive"){ elec_dt_adaptive = extract<int>(params[s1]); is_elec_dt_adaptive = 1; }
+    else if(s1=="elec_dt_tol"){ elec_dt_tol = extract<double>(params[s1]); is_elec_dt_tol = 1; }
+    else if(s1=="elec_dt_min"){ elec_dt_min = extract<double>(params[s1]); is_elec_dt_min = 1; }
+    else if(s1=="elec_dt_max"){ elec_dt_max = extract<double>(params[s1]); is_elec_dt_max = 1; }
     else if(s1=="runtype"){ runtype = extract<std::string>(params[s1]); is_runtype = 1; }
 
     else if(s1=="alp_bet"){ alp_bet = extract<int>(params[s1]); is_alp_bet = 1; }
     else if(s1=="decoherence"){ decoherence = extract<int>(params[s1]); is_decoherence = 1; }
     else if(s1=="regress_mode"){ regress_mode = extract<int>(params[s1]); is_regress_mode = 1; }
+    else if(s1=="dish_events"){ dish_events = extract<int>(params[s1]); is_dish_events = 1; }
+    else if(s1=="dish_pop_tol"){ dish_pop_tol = extract<double>(params[s1]); is_dish_pop_tol = 1; }
+    else if(s1=="spectral_output"){ spectral_output = extract<int>(params[s1]); is_spectral_output = 1; }
+    else if(s1=="scaling_output"){ scaling_output = extract<int>(params[s1]); is_scaling_output = 1; }
+    else if(s1=="deco_rates_policy"){ deco_rates_policy = extract<std::string>(params[s1]); is_deco_rates_policy = 1; }
+    else if(s1=="deco_rates_cache"){ deco_rates_cache = extract<int>(params[s1]); is_deco_rates_cache = 1; }
 
     else if(s1=="is_field"){ is_field = extract<int>(params[s1]); is_is_field = 1; }
     else if(s1=="field_dir"){ field_dir = extract<std::string>(params[s1]); is_field_dir = 1; }
@@ -254,6 +288,65 @@ void InputStructure::sanity_check(){
     exit(0);
   }
 
+  // Event-driven DISH
+  if(dish_events==0 || dish_events==1){ ;; }
+  else{
+    cout<<"Error: dish_events = "<<dish_events<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"        0    -  decoherence of every state is checked on every nuclear step (default)\n";
+    cout<<"        1    -  decoherence times are predicted and only the due events are processed\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+  if(dish_pop_tol<0.0 || dish_pop_tol>=1.0){
+    cout<<"Error: dish_pop_tol = "<<dish_pop_tol<<" must be in the range [0,1)\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+
+  // Spectral density output
+  if(spectral_output==0 || spectral_output==1 || spectral_output==2){ ;; }
+  else{
+    cout<<"Error: spectral_output = "<<spectral_output<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"        0    -  spectral densities are kept in memory only (default)\n";
+    cout<<"        1    -  all spectral densities of an initial condition go to one binary file spectral_density_icond<k>.bin\n";
+    cout<<"        2    -  one text file icond<k>pair<i>_<j>Spectral_density.txt for each pair of states\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+
+  if(scaling_output==0 || scaling_output==1){ ;; }
+  else{
+    cout<<"Error: scaling_output = "<<scaling_output<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"        0    -  NAC scaling factors are not written (default)\n";
+    cout<<"        1    -  NAC scaling factors are written to scaling_factors_icond<k>.txt\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+
+  // Decoherence rates reuse
+  if(deco_rates_policy=="icond" || deco_rates_policy=="rank" || deco_rates_policy=="global"){ ;; }
+  else{
+    cout<<"Error: deco_rates_policy = "<<deco_rates_policy<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"     icond    -   rates are computed from the trajectory window of each initial condition (default)\n";
+    cout<<"     rank     -   rates are computed once from the window of the first initial condition of this process\n";
+    cout<<"     global   -   rates are computed once from the whole trajectory spanned by all initial conditions\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+  if(deco_rates_cache==0 || deco_rates_cache==1){ ;; }
+  else{
+    cout<<"Error: deco_rates_cache = "<<deco_rates_cache<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"        0    -  decoherence rates are always computed (default)\n";
+    cout<<"        1    -  decoherence rates are read from/written to decoherence_cache_t<start>_n<length>_r<regress_mode>.bin in scratch_dir\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+
   // File reading-related options
   if(read_couplings=="online" || read_couplings=="batch" || 
      read_couplings=="online_all_in_one" || read_couplings=="batch_all_in_one"){ ;; }
@@ -273,7 +366,7 @@ void InputStructure::sanity_check(){
   }
 
   // Integrator-related options
-  if(integrator==0 || integrator==10 || integrator==11 || integrator==2){ ;; }
+  if(integrator==0 || integrator==10 || integrator==11 || integrator==2 || integrator==4){ ;; }
   else{
     cout<<"Error: integrator = "<<integrator<<" is not known\n";
     cout<<"Allowed values are:\n";
@@ -281,6 +374,7 @@ void InputStructure::sanity_check(){
     cout<<"     10  - Finite difference with first order for the dH/dt evaluation\n";
     cout<<"     11  - Finite difference with second order for the dH/dt evaluation\n";
     cout<<"     2   - Exact solution (matrix exponent). May be very slow for big # of states\n";
+    cout<<"     4   - 4-th order Magnus (matrix exponent) with H(t) interpolated between nuclear steps\n";
     cout<<"Exiting...\n";
     exit(0);
   }
@@ -294,10 +388,72 @@ void InputStructure::sanity_check(){
     exit(0);
   }
 
+  // Adaptive electronic time step
+  if(elec_dt_adaptive==0 || elec_dt_adaptive==1){ ;; }
+  else{
+    cout<<"Error: elec_dt_adaptive = "<<elec_dt_adaptive<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"     0   - fixed electronic time step elec_dt (default)\n";
+    cout<<"     1   - number of electronic steps per nuclear step is chosen by step doubling error estimate\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+  if(elec_dt_adaptive){
+    if(integrator!=0){
+      cout<<"Error: Adaptive electronic time step is only implemented for integrator = 0\n";
+      cout<<"Exiting...\n";
+      exit(0);
+    }
+    if(decoherence==5){
+      // The step is chosen with the plain Trotter propagator, not with the CPF one
+      cout<<"Error: Adaptive electronic time step is not implemented for decoherence = 5 (CPF)\n";
+      cout<<"Exiting...\n";
+      exit(0);
+    }
+    if(elec_dt_tol<=0.0){
+      cout<<"Error: elec_dt_tol = "<<elec_dt_tol<<" must be positive\nExiting...\n"; exit(0);
+    }
+    if(elec_dt_min<=0.0 || elec_dt_min>elec_dt_max || elec_dt_max>nucl_dt){
+      cout<<"Error: Adaptive time step bounds must satisfy 0 < elec_dt_min <= elec_dt_max <= nucl_dt\n";
+      cout<<"elec_dt_min = "<<elec_dt_min<<" elec_dt_max = "<<elec_dt_max<<" nucl_dt = "<<nucl_dt<<endl;
+      cout<<"Exiting...\n";
+      exit(0);
+    }
+  }
+
+  // Batched propagation of trajectories
+  if(sh_batch<0){
+    cout<<"Error: sh_batch = "<<sh_batch<<" is not known\n";
+    cout<<"Allowed values are:\n";
+    cout<<"     0   - trajectories are propagated one at a time (default)\n";
+    cout<<"     K>0 - K trajectories are propagated together\n";
+    cout<<"Exiting...\n";
+    exit(0);
+  }
+  if(sh_batch>0){
+    if(integrator!=0 || elec_dt_adaptive || sh_algo!=0){
+      cout<<"Error: sh_batch is only implemented for integrator = 0, sh_algo = 0 and fixed electronic time step\n";
+      cout<<"Exiting...\n";
+      exit(0);
+    }
+    if(!(decoherence>=0 && decoherence<=4)){
+      cout<<"Error: sh_batch is only implemented for decoherence = 0, 1, 2, 3, 4\n";
+      cout<<"Exiting...\n";
+      exit(0);
+    }
+  }
+
   // Field-related options
   if(is_field){
+    if(integrator==4){
+      // the Magnus Hamiltonians are built from Hcurr and dHdt only, without Ef*Hprime
+      cout<<"Error: Field is not implemented for the 4-th order Magnus integrator (integrator = 4)\n";
+      cout<<"Exiting...\n";
+      exit(0);
+    }
     if(integrator!=0){
-      cout<<"Error: Field is only implemented for integrator = "<<integrator<<endl;
+      // integrator 2 does not include the coupling to the field
+      cout<<"Error: Field is only implemented for integrator = 0, given integrator = "<<integrator<<endl;
       cout<<"Exiting...\n";
       exit(0);
     }
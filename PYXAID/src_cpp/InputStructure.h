@@ -56,9 +56,14 @@ public:
   int integrator;   int is_integrator;     // choose integration algorithm
   double nucl_dt;   int is_nucl_dt;        // nuclear time step in fs
   double elec_dt;   int is_elec_dt;        // electronic time step in fs
+  int elec_dt_adaptive; int is_elec_dt_adaptive; // 1 - choose number of electronic steps per nuclear step adaptively
+  double elec_dt_tol;   int is_elec_dt_tol;      // local error tolerance on the coefficients for adaptive stepping
+  double elec_dt_min;   int is_elec_dt_min;      // smallest electronic time step allowed in adaptive mode, fs
+  double elec_dt_max;   int is_elec_dt_max;      // largest electronic time step allowed in adaptive mode, fs
   int namdtime;     int is_namdtime;
   int sh_algo;      int is_sh_algo;        // surface hopping algorithm: 0 = FSSH, 1 = GFSH, 2 = MSSH
   int num_sh_traj;  int is_num_sh_traj;
+  int sh_batch;     int is_sh_batch;       // number of trajectories propagated together, 0 - one at a time
   int boltz_flag;   int is_boltz_flag;
   double Temp;      int is_Temp;           // Temperature
   int debug_flag;   int is_debug_flag;
@@ -66,6 +71,12 @@ public:
   int alp_bet;      int is_alp_bet;        // coupling between alpha and beta chanels, 1 - yes, 0 - no
   int decoherence;  int is_decoherence;    // choose the decoherence method to use; 0 - no decoherence
   int regress_mode; int is_regress_mode;   // regression mode used during dephasing times calculations
+  int dish_events;  int is_dish_events;    // 1 - DISH with the decoherence rates reused while the populations change by less than dish_pop_tol
+  double dish_pop_tol; int is_dish_pop_tol; // population change that triggers an update of the decoherence rates
+  int spectral_output; int is_spectral_output; // how to dump spectral densities: 0 - no, 1 - one binary file, 2 - text files
+  int scaling_output; int is_scaling_output;   // 1 - write NAC scaling factors (decoherence = 2, 3, 4) to file
+  std::string deco_rates_policy; int is_deco_rates_policy; // trajectory window for decoherence rates: icond, rank, global
+  int deco_rates_cache; int is_deco_rates_cache; // 1 - reuse decoherence rates cached in scratch_dir
 
   // Electromagnetic field
   int is_field;             int is_is_field;       // flag to include explicit field
@@ -0,0 +1,193 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
+#include "fft.h"
+#include <cmath>
+#include <iostream>
+#include <stdlib.h>
+#ifdef PYXAID_USE_FFTW
+#include <fftw3.h>
+#endif
+
+/*****************************************************************
+  Functions implemented in this file:
+
+  int fft_size(int n)
+  void fft(vector< complex<double> >& a,int dir)
+  void fft_any(vector< complex<double> >& a,int dir)
+  void correlation(vector<double>& x,int m,vector<double>& y,int nt,vector<double>& r)
+  void chirp_z(vector< complex<double> >& c,double alpha,int nk,vector< complex<double> >& X)
+
+*****************************************************************/
+
+
+int fft_size(int n){
+  int N = 1;
+  while(N<n){ N *= 2; }
+  return N;
+}
+
+#ifdef PYXAID_USE_FFTW
+static void fftw_transform(vector< complex<double> >& a,int dir){
+/***********************************************
+ In-place transform of any size with FFTW, same convention as fft()
+ complex<double> has the same layout as fftw_complex. The planner
+ is not thread-safe, hence the critical sections
+************************************************/
+  int N = a.size();
+  fftw_complex* x = reinterpret_cast<fftw_complex*>(&a[0]);
+  fftw_plan p;
+  #pragma omp critical(pyxaid_fftw_plan)
+  p = fftw_plan_dft_1d(N,x,x,(dir<0)?FFTW_FORWARD:FFTW_BACKWARD,FFTW_ESTIMATE);
+  fftw_execute(p);
+  #pragma omp critical(pyxaid_fftw_plan)
+  fftw_destroy_plan(p);
+}
+#endif
+
+void fft(vector< complex<double> >& a,int dir){
+/***********************************************
+ Iterative radix-2 FFT, done in place
+ dir = -1: forward transform  a[k] = sum_t a[t]*exp(-i*2pi*k*t/N)
+ dir =  1: backward transform a[k] = sum_t a[t]*exp( i*2pi*k*t/N)
+ No normalization is applied. N = a.size() must be a power of 2
+************************************************/
+  int N = a.size();
+  if(N<=1){ return; }
+  if(N & (N-1)){ std::cout<<"Error in fft: size "<<N<<" is not a power of 2\nExiting...\n"; exit(0); }
+
+#ifdef PYXAID_USE_FFTW
+  fftw_transform(a,dir); return;
+#endif
+
+  // Bit reversal permutation
+  int j = 0;
+  for(int i=1;i<N;i++){
+    int bit = N>>1;
+    while(j & bit){ j ^= bit; bit >>= 1; }
+    j |= bit;
+    if(i<j){ complex<double> tmp = a[i]; a[i] = a[j]; a[j] = tmp; }
+  }
+
+  // Butterflies
+  for(int len=2;len<=N;len<<=1){
+    int half = len>>1;
+    double ang = dir*2.0*M_PI/len;
+    for(int k=0;k<half;k++){
+      complex<double> w(cos(ang*k),sin(ang*k));
+      for(int i=k;i<N;i+=len){
+        complex<double> u = a[i];
+        complex<double> v = a[i+half]*w;
+        a[i] = u + v;
+        a[i+half] = u - v;
+      }// for i
+    }// for k
+  }// for len
+}
+
+void fft_any(vector< complex<double> >& a,int dir){
+/***********************************************
+ In place transform of arbitrary size N = a.size()
+ dir = -1: forward transform  a[k] = sum_t a[t]*exp(-i*2pi*k*t/N)
+ dir =  1: backward transform a[k] = sum_t a[t]*exp( i*2pi*k*t/N)
+ No normalization is applied. Powers of 2 go to fft(), other sizes
+ are done with Bluestein's algorithm (as in chirp_z) using FFTs of
+ size L >= 2N-1, so the cost is O(N*log(N)) for any N. The chirp
+ phases pi*m^2/N are reduced modulo 2pi exactly (m^2 mod 2N), so
+ the accuracy does not degrade for large N
+************************************************/
+  int N = a.size();
+  if(N<=1){ return; }
+
+#ifdef PYXAID_USE_FFTW
+  fftw_transform(a,dir); return;
+#endif
+
+  if(!(N & (N-1))){ fft(a,dir); return; }
+
+  int L = fft_size(2*N-1);
+  vector< complex<double> > x(L,complex<double>(0.0,0.0));
+  vector< complex<double> > b(L,complex<double>(0.0,0.0));
+
+  // chirp w[m] = exp(dir*i*pi*m^2/N)
+  vector< complex<double> > w(N);
+  long long N2 = 2*(long long)N;
+  for(int m=0;m<N;m++){
+    double phi = dir*M_PI*((double)(((long long)m*(long long)m) % N2))/((double)N);
+    w[m] = complex<double>(cos(phi),sin(phi));
+  }
+
+  for(int m=0;m<N;m++){ x[m] = a[m]*w[m]; b[m] = conj(w[m]); }
+  for(int m=1;m<N;m++){ b[L-m] = conj(w[m]); }
+
+  fft(x,-1);
+  fft(b,-1);
+  for(int k=0;k<L;k++){ x[k] *= b[k]; }
+  fft(x,1);
+
+  for(int k=0;k<N;k++){ a[k] = w[k]*x[k]/((double)L); }
+}
+
+void correlation(vector<double>& x,int m,vector<double>& y,int nt,vector<double>& r){
+/***********************************************
+ r[t] = sum_{n=0}^{m-1} x[n]*y[n+t], for t = 0,...,nt-1
+ y must have at least m+nt-1 elements
+ Computed via FFT in O(L*log(L)) with L >= m+nt-1 instead of O(m*nt)
+************************************************/
+  int ny = m+nt-1;
+  if((int)y.size()<ny){ std::cout<<"Error in correlation: vector y is too short\nExiting...\n"; exit(0); }
+
+  int L = fft_size(ny);
+  vector< complex<double> > fx(L,complex<double>(0.0,0.0));
+  vector< complex<double> > fy(L,complex<double>(0.0,0.0));
+  for(int n=0;n<m;n++){  fx[n] = x[n]; }
+  for(int n=0;n<ny;n++){ fy[n] = y[n]; }
+
+  fft(fx,-1);
+  fft(fy,-1);
+  for(int k=0;k<L;k++){  fy[k] *= conj(fx[k]); }
+  fft(fy,1);
+
+  r = vector<double>(nt,0.0);
+  for(int t=0;t<nt;t++){  r[t] = fy[t].real()/((double)L); }
+}
+
+void chirp_z(vector< complex<double> >& c,double alpha,int nk,vector< complex<double> >& X){
+/***********************************************
+ X[k] = sum_{t=0}^{n-1} c[t]*exp(-i*alpha*k*t), k = 0,...,nk-1, n = c.size()
+ Bluestein's algorithm: k*t = (k^2 + t^2 - (k-t)^2)/2, so the sum 
+ becomes a convolution with the chirp exp(i*alpha*m^2/2), computed 
+ with FFT of size L >= n+nk-1
+************************************************/
+  int n = c.size();
+  int L = fft_size(n+nk-1);
+
+  vector< complex<double> > a(L,complex<double>(0.0,0.0));
+  vector< complex<double> > b(L,complex<double>(0.0,0.0));
+
+  // chirp w[m] = exp(-i*alpha*m^2/2), m = 0,...,max(n,nk)-1
+  int mmax = (n>nk)?n:nk;
+  vector< complex<double> > w(mmax);
+  for(int m=0;m<mmax;m++){
+    double phi = 0.5*alpha*((double)m)*((double)m);
+    w[m] = complex<double>(cos(phi),-sin(phi));
+  }
+
+  for(int m=0;m<n;m++){  a[m] = c[m]*w[m]; }
+  for(int m=0;m<nk;m++){ b[m] = conj(w[m]); }
+  for(int m=1;m<n;m++){  b[L-m] = conj(w[m]); }
+
+  fft(a,-1);
+  fft(b,-1);
+  for(int k=0;k<L;k++){ a[k] *= b[k]; }
+  fft(a,1);
+
+  X = vector< complex<double> >(nk);
+  for(int k=0;k<nk;k++){  X[k] = w[k]*a[k]/((double)L); }
+}
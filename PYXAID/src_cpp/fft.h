@@ -0,0 +1,30 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex>
+#include <vector>
+using namespace std;
+
+// Fast Fourier transforms and related operations
+
+int fft_size(int n);   // smallest power of 2 not smaller than n
+void fft(vector< complex<double> >& a,int dir);  // radix-2, in place: a[k] = sum_t a[t]*exp(dir*i*2pi*k*t/N)
+void fft_any(vector< complex<double> >& a,int dir);  // same as fft, but for any N (Bluestein if N is not a power of 2)
+
+// r[t] = sum_{n=0}^{m-1} x[n]*y[n+t], for t = 0,...,nt-1
+void correlation(vector<double>& x,int m,vector<double>& y,int nt,vector<double>& r);
+
+// X[k] = sum_{t=0}^{n-1} c[t]*exp(-i*alpha*k*t), for k = 0,...,nk-1 (Bluestein's algorithm)
+void chirp_z(vector< complex<double> >& c,double alpha,int nk,vector< complex<double> >& X);
+
+
+#endif // FFT_H
@@ -0,0 +1,61 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
+#include <iostream>
+#include <stdlib.h>
+#include "matrix.h"
+#include "fft_export.h"
+#include <boost/python.hpp>
+
+using namespace boost::python;
+using namespace std;
+
+
+boost::python::list dft_columns(boost::python::list cols,int dir){
+/***************************************
+  Batch transform for Python: cols is a list of columns (lists of
+  real or complex numbers, all of the same length). Every column is
+  transformed with dft_cols: dir = -1 - forward (as dft),
+  dir = 1 - inverse (as inv_dft, with 1/N). Returns the list of the
+  transformed columns (lists of complex numbers)
+  e.g. in Python: F = pyxaid_core.dft_columns([x1, x2, x3], -1)
+****************************************/
+
+  int ncols = len(cols);
+  boost::python::list res;
+  if(ncols==0){ return res; }
+
+  int N = len(cols[0]);
+  for(int j=1;j<ncols;j++){
+    if(len(cols[j])!=N){
+      cout<<"Error in dft_columns: column "<<j<<" has "<<len(cols[j])<<" elements, expected "<<N<<"\nExiting...\n"; exit(0);
+    }
+  }
+  if(N==0){ for(int j=0;j<ncols;j++){ res.append(boost::python::list()); } return res; }
+
+  matrix in(N,ncols), out(N,ncols);
+  for(int j=0;j<ncols;j++){
+    for(int n=0;n<N;n++){ in.M[n*ncols+j] = extract< complex<double> >(cols[j][n]); }
+  }
+
+  dft_cols(in,out,dir);
+
+  for(int j=0;j<ncols;j++){
+    boost::python::list col;
+    for(int k=0;k<N;k++){ col.append(out.M[k*ncols+j]); }
+    res.append(col);
+  }
+  return res;
+}
+
+
+void export_fft(){
+  def("dft_columns",&dft_columns);
+
+}
@@ -0,0 +1,15 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
+#ifndef fft_export_h
+#define fft_export_h
+
+void export_fft();
+
+#endif // fft_export_h
@@ -8,10 +8,198 @@
 ***********************************************************/
 
 #include "matrix.h"
+#include "small_matrix.h"
+#include "fft.h"
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
 using namespace std;
 
+#ifdef PYXAID_USE_BLAS
+extern "C" void zgemm_(const char* transa,const char* transb,const int* m,const int* n,const int* k,
+                       const complex<double>* alpha,const complex<double>* A,const int* lda,
+                       const complex<double>* B,const int* ldb,
+                       const complex<double>* beta,complex<double>* C,const int* ldc);
+#endif
+
+// Matrix product kernel parameters
+#define GEMM_SMALL 4096        // below this number of multiply-adds the product is done without blocking
+#define GEMM_BLAS_MIN 262144   // from this number of multiply-adds zgemm is used (with -DPYXAID_USE_BLAS)
+#define GEMM_BLOCK_K 64        // block of the summation index
+#define GEMM_BLOCK_J 256       // block of the columns of the result
+#define GEMM_DOT_BLOCK_K 1024  // gemm_dot: block of the summation index
+#define GEMM_DOT_BLOCK_J 16    // gemm_dot: block of the rows of B
+
+// Automatic choice of the matrix exponential: for the sizes done by small_exp, Hermitian matrices
+// with |A|_1 above this (more than 6 squarings in expm_pade) are exponentiated via eigenvectors
+#define EXPM_PADE_MAX_NORM (5.371920351148152*64.0)
+
+void gemm(int nr,int nk,int nc,const complex<double>* A,const complex<double>* B,complex<double>* C){
+/*****************************************************************
+  C = A * B, for row-major A (nr x nk), B (nk x nc) and C (nr x nc)
+  C must not overlap with A or B. For every element the sum over k is
+  accumulated in the same order as in the textbook triple loop
+*****************************************************************/
+  double nops = double(nr)*double(nk)*double(nc);
+
+#ifdef PYXAID_USE_BLAS
+  if(nops>=GEMM_BLAS_MIN){
+    // Row-major C = A*B is column-major C^T = B^T * A^T
+    complex<double> one(1.0,0.0), zero(0.0,0.0);
+    zgemm_("N","N",&nc,&nr,&nk,&one,B,&nc,A,&nk,&zero,C,&nc);
+    return;
+  }
+#endif
+
+  if(nops<GEMM_SMALL){
+    // Row by row: C[i][:] += A[i][k] * B[k][:], contiguous access to B and C
+    for(int i=0;i<nr;i++){
+      complex<double>* c = &C[i*nc];
+      for(int j=0;j<nc;j++){ c[j] = 0.0; }
+      for(int k=0;k<nk;k++){
+        double ar = A[i*nk+k].real(), ai = A[i*nk+k].imag();
+        const complex<double>* b = &B[k*nc];
+        for(int j=0;j<nc;j++){
+          double br = b[j].real(), bi = b[j].imag();
+          c[j] = complex<double>(c[j].real() + (ar*br - ai*bi), c[j].imag() + (ar*bi + ai*br));
+        }
+      }
+    }
+    return;
+  }
+
+  // Real and imaginary parts are split, so that the innermost loop is a plain loop over
+  // doubles which is vectorized by the compiler. B is traversed in GEMM_BLOCK_K x GEMM_BLOCK_J
+  // panels that stay in cache while all rows of A are multiplied by them
+  vector<double> Br(nk*nc), Bi(nk*nc), Cr(nr*nc,0.0), Ci(nr*nc,0.0);
+  for(int i=0;i<nk*nc;i++){ Br[i] = B[i].real(); Bi[i] = B[i].imag(); }
+
+  for(int jj=0;jj<nc;jj+=GEMM_BLOCK_J){
+    int jn = (nc-jj<GEMM_BLOCK_J)? nc-jj : GEMM_BLOCK_J;
+
+    for(int kk=0;kk<nk;kk+=GEMM_BLOCK_K){
+      int kn = (nk-kk<GEMM_BLOCK_K)? nk-kk : GEMM_BLOCK_K;
+
+      for(int i=0;i<nr;i++){
+        double* cr = &Cr[i*nc+jj];
+        double* ci = &Ci[i*nc+jj];
+
+        for(int k=kk;k<kk+kn;k++){
+          double ar = A[i*nk+k].real(), ai = A[i*nk+k].imag();
+          const double* br = &Br[k*nc+jj];
+          const double* bi = &Bi[k*nc+jj];
+
+          #pragma omp simd
+          for(int j=0;j<jn;j++){
+            cr[j] += (ar*br[j] - ai*bi[j]);
+            ci[j] += (ar*bi[j] + ai*br[j]);
+          }
+        }// for k
+      }// for i
+    }// for kk
+  }// for jj
+
+  for(int i=0;i<nr*nc;i++){ C[i] = complex<double>(Cr[i],Ci[i]); }
+
+}
+
+template<class T>
+static const double* dot_chunk(const T* x,int n,double* buf){
+// n numbers from x as doubles: converted into buf
+  for(int k=0;k<n;k++){ buf[k] = x[k]; }
+  return buf;
+}
+static const double* dot_chunk(const double* x,int,double*){ return x; }  // doubles are used in place, no copy
+
+template<class T>
+static void gemm_dot_kernel(int nr,int nc,int nk,const T* a,const T* b,complex<double>* C){
+/*****************************************************************
+  Bundled kernel of gemm_dot: a and b are A and B as arrays of 2*nr*nk
+  and 2*nc*nk numbers of type T
+*****************************************************************/
+  // The rows are read as interleaved (re,im) numbers, so the loop over k is a plain
+  // loop over doubles vectorized by the compiler. 2 rows of A times 2 rows of B are
+  // done at once (each loaded element is used twice). The summation is split into
+  // GEMM_DOT_BLOCK_K chunks and the rows of B into GEMM_DOT_BLOCK_J panels, so that
+  // a panel of B stays in cache while all rows of A are multiplied by it. For T = float
+  // every chunk is converted to double once, as it is loaded, and all sums are in double
+  vector<double> bbuf(2*GEMM_DOT_BLOCK_J*GEMM_DOT_BLOCK_K), abuf(4*GEMM_DOT_BLOCK_K);
+  const double* bp[GEMM_DOT_BLOCK_J];
+  for(int i=0;i<nr*nc;i++){ C[i] = 0.0; }
+
+  for(int jj=0;jj<nc;jj+=GEMM_DOT_BLOCK_J){
+    int jn = (nc-jj<GEMM_DOT_BLOCK_J)? nc-jj : GEMM_DOT_BLOCK_J;
+
+    for(int kk=0;kk<nk;kk+=GEMM_DOT_BLOCK_K){
+      int kn = (nk-kk<GEMM_DOT_BLOCK_K)? nk-kk : GEMM_DOT_BLOCK_K;
+      for(int j=0;j<jn;j++){ bp[j] = dot_chunk(&b[2*((jj+j)*nk+kk)],2*kn,&bbuf[2*j*GEMM_DOT_BLOCK_K]); }
+
+      for(int i0=0;i0<nr;i0+=2){
+        int i1 = (i0+1<nr)? i0+1 : i0;   // the last odd row is done twice, but stored once
+        const double* a0 = dot_chunk(&a[2*(i0*nk+kk)],2*kn,&abuf[0]);
+        const double* a1 = dot_chunk(&a[2*(i1*nk+kk)],2*kn,&abuf[2*GEMM_DOT_BLOCK_K]);
+
+        for(int j0=0;j0<jn;j0+=2){
+          int j1 = (j0+1<jn)? j0+1 : j0;
+          const double* b0 = bp[j0];
+          const double* b1 = bp[j1];
+          double r00 = 0.0, s00 = 0.0, r01 = 0.0, s01 = 0.0;
+          double r10 = 0.0, s10 = 0.0, r11 = 0.0, s11 = 0.0;
+
+          #pragma omp simd reduction(+:r00,s00,r01,s01,r10,s10,r11,s11)
+          for(int k=0;k<kn;k++){
+            double x0 = a0[2*k], y0 = a0[2*k+1], x1 = a1[2*k], y1 = a1[2*k+1];
+            double u0 = b0[2*k], v0 = b0[2*k+1], u1 = b1[2*k], v1 = b1[2*k+1];
+            r00 += x0*u0 + y0*v0;  s00 += x0*v0 - y0*u0;
+            r01 += x0*u1 + y0*v1;  s01 += x0*v1 - y0*u1;
+            r10 += x1*u0 + y1*v0;  s10 += x1*v0 - y1*u0;
+            r11 += x1*u1 + y1*v1;  s11 += x1*v1 - y1*u1;
+          }
+
+          C[i0*nc+jj+j0] += complex<double>(r00,s00);
+          if(j1!=j0){ C[i0*nc+jj+j1] += complex<double>(r01,s01); }
+          if(i1!=i0){
+            C[i1*nc+jj+j0] += complex<double>(r10,s10);
+            if(j1!=j0){ C[i1*nc+jj+j1] += complex<double>(r11,s11); }
+          }
+        }// for j0
+      }// for i0
+    }// for kk
+  }// for jj
+
+}
+
+void gemm_dot(int nr,int nc,int nk,const complex<double>* A,const complex<double>* B,complex<double>* C){
+/*****************************************************************
+  C[i][j] = sum_k conj(A[i][k]) * B[j][k], for row-major A (nr x nk),
+  B (nc x nk) and C (nr x nc): all scalar products <a_i|b_j> of the
+  rows of A with the rows of B, C = conj(A) * B.T. No conjugated or
+  transposed copies of A and B are made. C must not overlap with A or B
+*****************************************************************/
+#ifdef PYXAID_USE_BLAS
+  if(double(nr)*double(nk)*double(nc)>=GEMM_BLAS_MIN){
+    // The rows of A and B are the columns of the column-major A.T and B.T (ld = nk), so
+    // B.H * A = conj(C).T in column-major, which is conj(C) in row-major
+    complex<double> one(1.0,0.0), zero(0.0,0.0);
+    zgemm_("C","N",&nc,&nr,&nk,&one,B,&nk,A,&nk,&zero,C,&nc);
+    for(int i=0;i<nr*nc;i++){ C[i] = std::conj(C[i]); }
+    return;
+  }
+#endif
+
+  gemm_dot_kernel(nr,nc,nk,reinterpret_cast<const double*>(A),reinterpret_cast<const double*>(B),C);
+
+}
+
+void gemm_dot(int nr,int nc,int nk,const complex<float>* A,const complex<float>* B,complex<double>* C){
+/*****************************************************************
+  Same as above for single precision A and B, the sums are accumulated
+  in double. Half of the memory traffic of the double precision version
+*****************************************************************/
+  gemm_dot_kernel(nr,nc,nk,reinterpret_cast<const float*>(A),reinterpret_cast<const float*>(B),C);
+}
+
+
 matrix::matrix(vector<vector<double> >& re_part,vector<vector<double> >& im_part){
 /*****************************************************************
   Constructor: creates a matrix from 2 2D-arrays - real and imaginary parts
@@ -65,31 +253,8 @@ matrix matrix::operator*(const matrix& ob){
     exit(0);  
   }
   else{
-    int n=ob.n_cols;
-    int kn; // k*n
-    int rn; // row*n
-    int rncols; // row*n_cols
-   
-    matrix Temp(n_rows,n);
-
-    rn = 0;
-    rncols = 0;
-    for(int row=0;row<n_rows;row++){
-      for(int col=0;col<n;col++){
-        complex<double> d(0.0,0.0);
-        /* Standard formulation
-        for(int k=0;k<n_cols;k++){ d+=M[row*n_cols+k]*ob.M[k*n+col];  }
-        Temp.M[row*n+col] = d;
-        */
-
-        // More efficient formulation
-        kn = 0;
-        for(int k=0;k<n_cols;k++){ d+=M[rncols+k]*ob.M[kn+col]; kn += n; }
-        Temp.M[rn+col] = d;
-      }
-      rn += n;
-      rncols += n_cols;
-    }
+    matrix Temp(n_rows,ob.n_cols);
+    gemm(n_rows,n_cols,ob.n_cols,M,ob.M,Temp.M);
     return Temp;
   }
 }
@@ -135,28 +300,10 @@ void matrix::operator*=(const matrix& ob){
   }
   else{
     int n=ob.n_cols;
-    // Counters
-    int rncols; // row*n_cols
-    int kn;     // k*n
-    int rn;     // row*n
     complex<double> *TM;
     TM = new complex<double>[n_rows*n];
-    //matrix Temp(n_rows,n);
 
-    rn = 0;
-    rncols = 0;
-    for(int row=0;row<n_rows;row++){
-      for(int col=0;col<n;col++){
-        complex<double> d(0.0,0.0);
-
-        kn = 0;
-        for(int k=0;k<n_cols;k++){ d+=M[rncols+k]*ob.M[kn+col]; kn += n; }
-        TM[rn+col] = d;
-      }
-      rn += n;
-      rncols += n_cols;
-
-    }
+    gemm(n_rows,n_cols,n,M,ob.M,TM);
 
     for(int i=0;i<n_elts;i++){ M[i] = TM[i]; }
 
@@ -206,12 +353,23 @@ matrix& matrix::operator=(const matrix& ob){
 
 }
 
-matrix matrix::operator=(double num){
+#if __cplusplus >= 201103L
+matrix& matrix::operator=(matrix&& ob){
+// The right-hand side is a temporary: take its buffer, it will free ours
+  std::swap(n_rows,ob.n_rows);
+  std::swap(n_cols,ob.n_cols);
+  std::swap(n_elts,ob.n_elts);
+  std::swap(M,ob.M);
+  return *this;
+}
+#endif
+
+matrix& matrix::operator=(double num){
   for(int i=0;i<n_elts;i++){ M[i] = num;  }
   return *this;
 }
 
-matrix matrix::operator=(complex<double> num){
+matrix& matrix::operator=(complex<double> num){
   for(int i=0;i<n_elts;i++){ M[i] = num;  }
   return *this;
 }
@@ -240,7 +398,7 @@ matrix operator*(const matrix &m1, const complex<double>  &f){
   return m;
 }
 
-ostream& operator<<(ostream &strm,matrix ob){
+ostream& operator<<(ostream &strm,const matrix& ob){
   strm.setf(ios::showpoint);
   for(int i=0;i<ob.n_rows;i++){
     for(int j=0;j<ob.n_cols;j++){
@@ -260,6 +418,134 @@ istream& operator>>(istream& strm,matrix &ob){
 
 
 
+void axpy(double a,const matrix& x,matrix& y){
+  for(int i=0;i<y.n_elts;i++){ y.M[i] += x.M[i]*a; }
+}
+
+void axpy(const complex<double>& a,const matrix& x,matrix& y){
+  for(int i=0;i<y.n_elts;i++){ y.M[i] += a*x.M[i]; }
+}
+
+void hermitize(matrix& m){
+  int n = m.n_rows;
+  for(int i=0;i<n;i++){
+    m.M[i*n+i] = (m.M[i*n+i] + std::conj(m.M[i*n+i]))*0.5;
+    for(int j=i+1;j<n;j++){
+      complex<double> hij = (m.M[i*n+j] + std::conj(m.M[j*n+i]))*0.5;
+      m.M[i*n+j] = hij;
+      m.M[j*n+i] = std::conj(hij);
+    }
+  }
+}
+
+double hermiticity_error(const matrix& m){
+// 0 for Hermitian m. Only the diagonal and the upper triangle of m are kept by hermitian_matrix
+  int n = m.n_rows;
+  double err = 0.0, nrm = 0.0;
+  for(int i=0;i<n;i++){
+    for(int j=0;j<n;j++){
+      err += norm(m.M[i*n+j] - std::conj(m.M[j*n+i]));
+      nrm += norm(m.M[i*n+j]);
+    }
+  }
+  return (nrm>0.0)? sqrt(err/nrm) : 0.0;
+}
+
+void scale_cols(matrix& m,const matrix& d){
+  for(int i=0;i<m.n_rows;i++){
+    for(int j=0;j<m.n_cols;j++){
+      m.M[i*m.n_cols+j] *= d.M[j*d.n_cols+j];
+    }
+  }
+}
+
+
+//===================== Class hermitian_matrix ============================
+
+hermitian_matrix::hermitian_matrix(const matrix& m){
+  n = 0;
+  pack(m);
+}
+
+void hermitian_matrix::pack(const matrix& m){
+  if(m.n_rows!=m.n_cols){
+    std::cout<<"Error in hermitian_matrix::pack: matrix must be square, given "<<m.n_rows<<" by "<<m.n_cols<<"\n";
+    std::cout<<"Exiting...\n";
+    exit(0);
+  }
+  if(n!=m.n_rows){ *this = hermitian_matrix(m.n_rows); }
+
+  int k = 0;
+  for(int i=0;i<n;i++){
+    d[i] = m.M[i*n+i].real();
+    for(int j=i+1;j<n;j++){ u[k] = m.M[i*n+j]; k++; }
+  }
+}
+
+void hermitian_matrix::unpack(matrix& m) const{
+  int k = 0;
+  for(int i=0;i<n;i++){
+    m.M[i*n+i] = complex<double>(d[i],0.0);
+    for(int j=i+1;j<n;j++){
+      m.M[i*n+j] = u[k];
+      m.M[j*n+i] = std::conj(u[k]);
+      k++;
+    }
+  }
+}
+
+hermitian_matrix hermitian_matrix::operator+(const hermitian_matrix& ob) const{
+  hermitian_matrix Temp(n);
+  for(int i=0;i<n;i++){ Temp.d[i] = d[i] + ob.d[i]; }
+  for(size_t i=0;i<u.size();i++){ Temp.u[i] = u[i] + ob.u[i]; }
+  return Temp;
+}
+
+hermitian_matrix hermitian_matrix::operator-(const hermitian_matrix& ob) const{
+  hermitian_matrix Temp(n);
+  for(int i=0;i<n;i++){ Temp.d[i] = d[i] - ob.d[i]; }
+  for(size_t i=0;i<u.size();i++){ Temp.u[i] = u[i] - ob.u[i]; }
+  return Temp;
+}
+
+hermitian_matrix hermitian_matrix::operator/(double num) const{
+  hermitian_matrix Temp(n);
+  for(int i=0;i<n;i++){ Temp.d[i] = d[i]/num; }
+  for(size_t i=0;i<u.size();i++){ Temp.u[i] = u[i]/num; }
+  return Temp;
+}
+
+void hermitian_matrix::operator*=(double f){
+  for(int i=0;i<n;i++){ d[i] *= f; }
+  for(size_t i=0;i<u.size();i++){ u[i] *= f; }
+}
+
+hermitian_matrix& hermitian_matrix::operator=(double num){
+  for(int i=0;i<n;i++){ d[i] = num; }
+  for(size_t i=0;i<u.size();i++){ u[i] = num; }
+  return *this;
+}
+
+hermitian_matrix operator*(const double& f,const hermitian_matrix& m1){
+  hermitian_matrix m(m1.n);
+  for(int i=0;i<m1.n;i++){ m.d[i] = m1.d[i]*f; }
+  for(size_t i=0;i<m1.u.size();i++){ m.u[i] = m1.u[i]*f; }
+  return m;
+}
+
+ostream& operator<<(ostream &strm,const hermitian_matrix& ob){
+  matrix m(ob.n,ob.n);
+  ob.unpack(m);
+  strm<<m;
+  return strm;
+}
+
+void axpy(double a,const hermitian_matrix& x,hermitian_matrix& y){
+  for(int i=0;i<y.n;i++){ y.d[i] += x.d[i]*a; }
+  for(size_t i=0;i<y.u.size();i++){ y.u[i] += x.u[i]*a; }
+}
+
+
 matrix matrix::conj(){
   matrix m(n_rows,n_cols);
   for(int i=0;i<m.n_elts;i++){ m.M[i] = std::conj(M[i]); }
@@ -288,7 +574,7 @@ matrix matrix::H(){
 
 void matrix::load_identity(){
   for(int i=0;i<n_elts;i++){ M[i] = complex<double>(0.0,0.0); }
-  for(i=0;i<n_rows;i++){ M[i*n_cols+i] = complex<double>(1.0,0.0); }
+  for(int i=0;i<n_rows;i++){ M[i*n_cols+i] = complex<double>(1.0,0.0); }
 }
 
 
@@ -650,7 +936,7 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
  
     }
     // Fill out upper diagonal
-    for(i=0;i<n-1;i++){ 
+    for(int i=0;i<n-1;i++){ 
       // j = i+1
       if(i==n-2){  eval.M[i*n+(i+1)]  = R.M[i*n+i]*Q.M[i*n+(i+1)] + 
                                         R.M[i*n+(i+1)]*Q.M[(i+1)*n+(i+1)];}   // only 2 terms here
@@ -666,7 +952,7 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
     // m has a tridiagonal form, so judge convergence by the elements in
     // the closest off-diagonal
     stop = 0;
-    for(i=0;i<(n-1);i++){  
+    for(int i=0;i<(n-1);i++){  
       if(  (fabs(eval.M[i*n+(i+1)].real())<EPS) && (fabs(eval.M[i*n+(i+1)].imag())<EPS) ){
 
          // Element (i, j=i+1) is  "zero"
@@ -682,15 +968,15 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
            // copy diagonal elements
            for(int j=i+1;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
+           for(int j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
+           for(int j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
 
            vector<double> Eval_tmp(sz_dn,0.0);
            qr(EPS,sz_dn,dn,Eval_tmp);
 
            Eval[0] = eval.M[0].real();
-           for(j=1;j<n;j++){ Eval[j] = Eval_tmp[j-1]; } 
+           for(int j=1;j<n;j++){ Eval[j] = Eval_tmp[j-1]; } 
            Eval_tmp.clear();
 
          }
@@ -700,15 +986,15 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
            // copy diagonal elements
            for(int j=0;j<(n-1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=0;j<(n-2);j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
+           for(int j=0;j<(n-2);j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=1;j<(n-1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
+           for(int j=1;j<(n-1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
 
            vector<double> Eval_tmp(sz_up,0.0);
            qr(EPS,sz_up,up,Eval_tmp);
 
 
-           for(j=0;j<(n-1);j++){ Eval[j] = Eval_tmp[j]; } 
+           for(int j=0;j<(n-1);j++){ Eval[j] = Eval_tmp[j]; } 
            Eval[n-1] = eval.M[(n-1)*n+(n-1)].real();
            Eval_tmp.clear();
 
@@ -720,17 +1006,17 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
            // copy diagonal elements
            for(int j=i+1;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
+           for(int j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
+           for(int j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
 
            matrix up(sz_up,sz_up); up = 0.0;
            // copy diagonal elements
-           for(j=0;j<(i+1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
+           for(int j=0;j<(i+1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=0;j<i;j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
+           for(int j=0;j<i;j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=1;j<(i+1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
+           for(int j=1;j<(i+1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
 
 
            vector<double> Eval_tmp_up(sz_up,0.0);
@@ -739,8 +1025,8 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval){
            vector<double> Eval_tmp_dn(sz_dn,0.0);
            qr(EPS,sz_dn,dn,Eval_tmp_dn);
 
-           for(j=0;j<sz_up;j++){ Eval[j] = Eval_tmp_up[j]; } 
-           for(j=i+1;j<n;j++){ Eval[j] = Eval_tmp_dn[j-(i+1)]; } 
+           for(int j=0;j<sz_up;j++){ Eval[j] = Eval_tmp_up[j]; } 
+           for(int j=i+1;j<n;j++){ Eval[j] = Eval_tmp_dn[j-(i+1)]; } 
 
            Eval_tmp_up.clear();
            Eval_tmp_dn.clear();
@@ -810,7 +1096,7 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
     // The following steps are basically the efficient way to do:
     // eval = R * Q
     // Fill out the main diagonal
-    for(i=0;i<n;i++){ 
+    for(int i=0;i<n;i++){ 
       if(i==n-1){  eval.M[i*n+i]  = R.M[i*n+i]*Q.M[i*n+i];   }          // only 1 term here
       else{        eval.M[i*n+i]  = R.M[i*n+i]*Q.M[i*n+i] + R.M[i*n+(i+1)]*Q.M[(i+1)*n+i];}  // in fact just only 2 terms here
       // Shift:
@@ -818,7 +1104,7 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
  
     }
     // Fill out upper diagonal
-    for(i=0;i<n-1;i++){ 
+    for(int i=0;i<n-1;i++){ 
       // j = i+1
       if(i==n-2){  eval.M[i*n+(i+1)]  = R.M[i*n+i]*Q.M[i*n+(i+1)] + 
                                         R.M[i*n+(i+1)]*Q.M[(i+1)*n+(i+1)];}   // only 2 terms here
@@ -834,7 +1120,7 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
     // m has a tridiagonal form, so judge convergence by the elements in
     // the closest off-diagonal
     stop = 0;
-    for(i=0;i<(n-1);i++){  
+    for(int i=0;i<(n-1);i++){  
       if(  (fabs(eval.M[i*n+(i+1)].real())<EPS) && (fabs(eval.M[i*n+(i+1)].imag())<EPS) ){
 
          // Element (i, j=i+1) is  "zero"
@@ -850,22 +1136,22 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
            // copy diagonal elements
            for(int j=i+1;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
+           for(int j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
+           for(int j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
 
            vector<double> Eval_tmp(sz_dn,0.0);
            matrix Q_dn(sz_dn,sz_dn);
            qr(EPS,sz_dn,dn,Eval_tmp,Q_dn);
 
-           for(j=i+1;j<n;j++){
+           for(int j=i+1;j<n;j++){
              for(int k=i+1;k<n;k++){
                Q_tmp.M[j*n+k] = Q_dn.M[(j-(i+1))*sz_dn + (k-(i+1))];
              }
            }
 
            Eval[0] = eval.M[0].real();
-           for(j=1;j<n;j++){ Eval[j] = Eval_tmp[j-1]; } 
+           for(int j=1;j<n;j++){ Eval[j] = Eval_tmp[j-1]; } 
            Eval_tmp.clear();
 
          }
@@ -875,21 +1161,21 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
            // copy diagonal elements
            for(int j=0;j<(n-1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=0;j<(n-2);j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
+           for(int j=0;j<(n-2);j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=1;j<(n-1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
+           for(int j=1;j<(n-1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
 
            vector<double> Eval_tmp(sz_up,0.0);
            matrix Q_up(sz_up,sz_up);
            qr(EPS,sz_up,up,Eval_tmp,Q_up);
 
-           for(j=0;j<(i+1);j++){
+           for(int j=0;j<(i+1);j++){
              for(int k=0;k<(i+1);k++){
                Q_tmp.M[j*n+k] = Q_up.M[j*sz_up+k];
              }
            }
 
-           for(j=0;j<(n-1);j++){ Eval[j] = Eval_tmp[j]; } 
+           for(int j=0;j<(n-1);j++){ Eval[j] = Eval_tmp[j]; } 
            Eval[n-1] = eval.M[(n-1)*n+(n-1)].real();
            Eval_tmp.clear();
 
@@ -901,17 +1187,17 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
            // copy diagonal elements
            for(int j=i+1;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
+           for(int j=i+1;j<(n-1);j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
+           for(int j=i+2;j<n;j++){ dn.M[(j-(i+1))*sz_dn + (j-(i+1))-1] = eval.M[j*n+j-1]; }
 
            matrix up(sz_up,sz_up); up = 0.0;
            // copy diagonal elements
-           for(j=0;j<(i+1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
+           for(int j=0;j<(i+1);j++){ up.M[j*sz_up + j] = eval.M[j*n+j]; }
            // upper off-diagonal elements
-           for(j=0;j<i;j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
+           for(int j=0;j<i;j++){ up.M[j*sz_up + j+1] = eval.M[j*n+j+1]; }
            // lower off-diagonal elements
-           for(j=1;j<(i+1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
+           for(int j=1;j<(i+1);j++){ up.M[j*sz_up + j-1] = eval.M[j*n+j-1]; }
 
            vector<double> Eval_tmp_up(sz_up,0.0);
            matrix Q_up(sz_up,sz_up);
@@ -922,21 +1208,21 @@ void qr(double EPS,int n,matrix& eval,vector<double>& Eval,matrix& Evec){
            qr(EPS,sz_dn,dn,Eval_tmp_dn,Q_dn);
 
 
-           for(j=0;j<(i+1);j++){
+           for(int j=0;j<(i+1);j++){
              for(int k=0;k<(i+1);k++){
                Q_tmp.M[j*n+k] = Q_up.M[j*sz_up+k];
              }
            }
 
-           for(j=i+1;j<n;j++){
+           for(int j=i+1;j<n;j++){
              for(int k=i+1;k<n;k++){
                Q_tmp.M[j*n+k] = Q_dn.M[(j-(i+1))*sz_dn + (k-(i+1))];
              }
            }
 
 
-           for(j=0;j<sz_up;j++){ Eval[j] = Eval_tmp_up[j]; } 
-           for(j=i+1;j<n;j++){ Eval[j] = Eval_tmp_dn[j-(i+1)]; } 
+           for(int j=0;j<sz_up;j++){ Eval[j] = Eval_tmp_up[j]; } 
+           for(int j=i+1;j<n;j++){ Eval[j] = Eval_tmp_dn[j-(i+1)]; } 
 
            Eval_tmp_up.clear();
            Eval_tmp_dn.clear();
@@ -1061,20 +1347,20 @@ void matrix::eigen3(double EPS,vector<double>& Eval,matrix& Evec){
     // Instead of : A = m-Eval[i]*I;
     for(int j=0;j<n;j++){ m.M[j*n+j] -= Eval[i]; }
     // Initial guess
-    for(j=0;j<n;j++){ X.M[j] = gs; }
+    for(int j=0;j<n;j++){ X.M[j] = gs; }
 
     solve_linsys1(m,X,EPS,10000,1.4); // ~1.4 is optimum
 
     // Restore original m
-    for(j=0;j<n;j++){ m.M[j*n+j] += Eval[i]; }
+    for(int j=0;j<n;j++){ m.M[j*n+j] += Eval[i]; }
 
     // Compute norm of the solution vector
     double nrm = 0.0;
-    for(j=0;j<n;j++){ nrm += norm(X.M[j]); }
+    for(int j=0;j<n;j++){ nrm += norm(X.M[j]); }
     nrm = sqrt(1.0/nrm);
  
     // Normalize solution vector
-    for(j=0;j<n;j++){ Evec.M[j*n+i] = nrm*X.M[j]; }
+    for(int j=0;j<n;j++){ Evec.M[j*n+i] = nrm*X.M[j]; }
 
   }//for i
 
@@ -1214,19 +1500,174 @@ void matrix::tridiagonalize(matrix& T,matrix& H){
 
 
 
+static double norm1(const matrix& m){
+// 1-norm: maximal sum of the absolute values over columns
+  double res = 0.0;
+  for(int j=0;j<m.n_cols;j++){
+    double sum = 0.0;
+    for(int i=0;i<m.n_rows;i++){ sum += abs(m.M[i*m.n_cols+j]); }
+    if(sum>res){ res = sum; }
+  }
+  return res;
+}
+
+static int is_hermitian(const matrix& m,double eps){
+  int n = m.n_rows;
+  for(int i=0;i<n;i++){
+    for(int j=i;j<n;j++){
+      if(abs(m.M[i*n+j] - std::conj(m.M[j*n+i]))>eps){ return 0; }
+    }
+  }
+  return 1;
+}
+
+static void lu_solve(int n,int nrhs,complex<double>* A,complex<double>* B){
+/****************************************************************************
+  Solves A * X = B by Gaussian elimination with partial pivoting
+  A is n x n, B is n x nrhs, both are destroyed: X is returned in B
+*****************************************************************************/
+  for(int k=0;k<n;k++){
+    int p = k;
+    for(int i=k+1;i<n;i++){ if(abs(A[i*n+k])>abs(A[p*n+k])){ p = i; } }
+    if(A[p*n+k]==0.0){ cout<<"Error in lu_solve: matrix is singular\n"; exit(0); }
+    if(p!=k){
+      for(int j=0;j<n;j++){ std::swap(A[k*n+j],A[p*n+j]); }
+      for(int j=0;j<nrhs;j++){ std::swap(B[k*nrhs+j],B[p*nrhs+j]); }
+    }
+    complex<double> piv = 1.0/A[k*n+k];
+    for(int i=k+1;i<n;i++){
+      complex<double> f = A[i*n+k]*piv;
+      if(f==0.0){ continue; }
+      for(int j=k+1;j<n;j++){ A[i*n+j] -= f*A[k*n+j]; }
+      for(int j=0;j<nrhs;j++){ B[i*nrhs+j] -= f*B[k*nrhs+j]; }
+    }
+  }
+  for(int k=n-1;k>=0;k--){
+    complex<double> piv = 1.0/A[k*n+k];
+    for(int j=0;j<nrhs;j++){
+      complex<double> sum = B[k*nrhs+j];
+      for(int i=k+1;i<n;i++){ sum -= A[k*n+i]*B[i*nrhs+j]; }
+      B[k*nrhs+j] = sum*piv;
+    }
+  }
+}
+
+matrix expm_pade(matrix& m1,complex<double> scl){
+/****************************************************************************
+  Computes  exp(m1*scl) for a general square m1 by scaling and squaring:
+  exp(A) = r_m(A/2^s)^(2^s), where r_m = V^-1 * U is the [m/m] Pade 
+  approximant. The degree m = 3, 5, 7, 9, 13 and s are chosen from the
+  1-norm of A so that the backward error is below the double precision
+  unit roundoff (N.J. Higham, SIAM J. Matrix Anal. Appl. 26, 1179 (2005))
+  Costs a few matrix products and one linear solve - for small norms 
+  (e.g. short time steps) this is much less than a diagonalization
+*****************************************************************************/
+  if(m1.n_rows!=m1.n_cols){ cout<<"Error in expm_pade: Can not exponentiate non-square matrix\n"; exit(0); }
+  int n = m1.n_rows;
+
+  static const double theta[5] = {1.495585217958292e-2, 2.539398330063230e-1, 9.504178996162932e-1,
+                                  2.097847961257068, 5.371920351148152};
+  static const int deg[5] = {3, 5, 7, 9, 13};
+  static const double b[14] = {64764752532480000.0, 32382376266240000.0, 7771770303897600.0,
+                               1187353796428800.0, 129060195264000.0, 10559470521600.0,
+                               670442572800.0, 33522128640.0, 1323241920.0, 40840800.0,
+                               960960.0, 16380.0, 182.0, 1.0};    // m = 13
+  static const double b9[10] = {17643225600.0, 8821612800.0, 2075673600.0, 302702400.0, 30270240.0,
+                                2162160.0, 110880.0, 3960.0, 90.0, 1.0};
+  static const double b7[8] = {17297280.0, 8648640.0, 1995840.0, 277200.0, 25200.0, 1512.0, 56.0, 1.0};
+  static const double b5[6] = {30240.0, 15120.0, 3360.0, 420.0, 30.0, 1.0};
+  static const double b3[4] = {120.0, 60.0, 12.0, 1.0};
+
+  matrix A(m1);  A *= scl;
+  double nrm = norm1(A);
+
+  int m = 13, s = 0;
+  for(int k=0;k<4;k++){ if(nrm<=theta[k]){ m = deg[k]; break; } }
+  if(m==13 && nrm>theta[4]){
+    s = (int)ceil(log(nrm/theta[4])/log(2.0));
+    A *= pow(2.0,-s);
+  }
+
+  matrix I(n,n);  I.load_identity();
+  matrix A2(A*A);
+  matrix U(n,n), V(n,n);
+
+  if(m==13){
+    matrix A4(A2*A2);
+    matrix A6(A4*A2);
+
+    matrix W(A6*b[13]);  axpy(b[11],A4,W);  axpy(b[9],A2,W);
+    matrix X(A6*W);      axpy(b[7],A6,X);   axpy(b[5],A4,X);   axpy(b[3],A2,X);  axpy(b[1],I,X);
+    U = A*X;
+
+    W = A6*b[12];        axpy(b[10],A4,W);  axpy(b[8],A2,W);
+    V = A6*W;            axpy(b[6],A6,V);   axpy(b[4],A4,V);   axpy(b[2],A2,V);  axpy(b[0],I,V);
+  }
+  else{
+    const double* c = (m==3)? b3 : (m==5)? b5 : (m==7)? b7 : b9;
+    // Even powers A^0, A^2, ..., A^(m-1)
+    vector<matrix> P(1,I);  P.push_back(A2);
+    for(int k=2;2*k<m;k++){ P.push_back(P[k-1]*A2); }
+
+    matrix X(n,n);
+    for(size_t k=0;k<P.size();k++){ axpy(c[2*k+1],P[k],X);  axpy(c[2*k],P[k],V); }
+    U = A*X;
+  }
+
+  // r_m = (V - U)^-1 * (V + U)
+  matrix Q(V);  Q -= U;
+  matrix R(V);  R += U;
+  lu_solve(n,n,Q.M,R.M);
+
+  for(int k=0;k<s;k++){ R = R*R; }
+
+  return R;
+}
+
 matrix exp(matrix& m1,complex<double> scl,double eps){
+/****************************************************************************
+  Computes  exp(m1*scl), the algorithm is chosen automatically, see below
+*****************************************************************************/
+  return exp(m1,scl,eps,0);
+}
+
+matrix exp(matrix& m1,complex<double> scl,double eps,int alg){
 /****************************************************************************
   Computes  exp(m1*scl)
-  Works only for Hermitian m1: m1.H() = m1
+  alg = 1 - via eigenvectors of m1, works only for Hermitian m1: m1.H() = m1
+  alg = 2 - scaling and squaring Pade approximant, any m1, see expm_pade
+  alg = 0 - automatic: Pade, unless m1 is Hermitian and is small enough for
+            small_exp, and either n = 2 or |m1*scl| is large. For other sizes
+            the Pade approximant is both faster and more accurate than eigen()
 *****************************************************************************/
   if(m1.n_rows!=m1.n_cols){ cout<<"Error in exp: Can not exponentiate non-square matrix\n"; exit(0); }
   int n = m1.n_rows;
+
+  if(alg==0){
+    alg = 2;
+    int is_small = (n==2 || n==4 || n==8 || n==16 || n==32);
+    if(is_small && is_hermitian(m1,eps)){
+      if(n==2 || abs(scl)*norm1(m1)>EXPM_PADE_MAX_NORM){ alg = 1; }
+    }
+  }
+  if(alg==2){ return expm_pade(m1,scl); }
+
+  // Common small sizes: Jacobi on the stack, see small_matrix.h
+  switch(n){
+    case 2:  return small_exp<2>(m1,scl,eps);
+    case 4:  return small_exp<4>(m1,scl,eps);
+    case 8:  return small_exp<8>(m1,scl,eps);
+    case 16: return small_exp<16>(m1,scl,eps);
+    case 32: return small_exp<32>(m1,scl,eps);
+  }
+
   matrix evec(n,n),eval(n,n);//,inv_evec(n,n);
 
   m1.eigen(eps,eval,evec,2);
   for(int i=0;i<n;i++){  eval.M[i*n+i] = exp(eval.M[i*n+i].real()*scl); }
   //evec.direct_inverse(eps,inv_evec);  inv_evec = evec.H()
-  return (evec*eval*evec.H());
+  matrix res(evec);  scale_cols(res,eval);
+  return res*evec.H();
 }
  
 
@@ -1242,7 +1683,8 @@ matrix sin(matrix& m1,complex<double> scl, double eps){
   m1.eigen(eps,eval,evec,2);
   for(int i=0;i<n;i++){  eval.M[i*n+i] = sin(eval.M[i*n+i].real()*scl); }
 //  evec.direct_inverse(eps,inv_evec);
-  return (evec*eval*evec.H());
+  matrix res(evec);  scale_cols(res,eval);
+  return res*evec.H();
 }
 
 matrix cos(matrix& m1,complex<double> scl, double eps){
@@ -1257,7 +1699,8 @@ matrix cos(matrix& m1,complex<double> scl, double eps){
   m1.eigen(eps,eval,evec,2);
   for(int i=0;i<n;i++){  eval.M[i*n+i] = cos(eval.M[i*n+i].real()*scl); }
 //  evec.direct_inverse(eps,inv_evec);
-  return (evec*eval*evec.H());
+  matrix res(evec);  scale_cols(res,eval);
+  return res*evec.H();
 }
 
 matrix pow(matrix& m1,double nn, double eps){
@@ -1272,7 +1715,8 @@ matrix pow(matrix& m1,double nn, double eps){
   m1.eigen(eps,eval,evec,2);
   for(int i=0;i<n;i++){  eval.M[i*n+i] = pow(eval.M[i*n+i].real(),nn); }
 //  evec.direct_inverse(eps,inv_evec);
-  return (evec*eval*evec.H());
+  matrix res(evec);  scale_cols(res,eval);
+  return res*evec.H();
 }
 
 
@@ -1300,7 +1744,7 @@ void matrix::direct_inverse(double EPS,matrix& INV){
 
   for(int k=0;k<num_of_rows*num_of_cols;k++){ R_time[k]=M[k]; }
 
-  k=0;
+  int k=0;
   for(int i=0;i<num_of_cols;i++){
     for(int j=0;j<num_of_cols;j++){
       if(i==j) {L_time[k]=complex<double>(1.0,0.0);}
@@ -1342,7 +1786,7 @@ void matrix::direct_inverse(double EPS,matrix& INV){
     }// if !=0
   }// for row1
 
-  for(row1=num_of_rows-1;row1>0;row1--){
+  for(int row1=num_of_rows-1;row1>0;row1--){
     alpha=R_time[row1*num_of_cols+row1];
     R_time[row1*num_of_cols+row1]=complex<double>(1.0,0.0);
 
@@ -1618,25 +2062,15 @@ void dft(matrix& in,matrix& out){
 /***************************************
   Discrete Fourier Transform
   e.g. http://en.wikipedia.org/wiki/Fast_Fourier_transform
+  out[k] = sum_n in[n]*exp(-i*2pi*k*n/N), done by fft_any in O(N*log(N))
 ****************************************/
 
   int N = in.n_elts; // <in> and <out> are the vectors with n elements: n x 1
-  complex<double> f,mul;
-  double arg;
-
-  for(int k=0;k<N;k++){
+  vector< complex<double> > a(in.M,in.M+N);
 
-    out.M[k] = 0.0;
-    arg = 2.0*M_PI*k/((double)N);
+  fft_any(a,-1);
 
-    f = complex<double>(cos(arg),-sin(arg));
-    mul = 1.0;
-
-    for(int n=0;n<N;n++){
-      out.M[k] += in.M[n]*mul;
-      mul *= f;
-    }// for j
-  }// for i
+  for(int k=0;k<N;k++){ out.M[k] = a[k]; }
 
 }
 
@@ -1644,29 +2078,36 @@ void inv_dft(matrix& in,matrix& out){
 /***************************************
   Inverse Discrete Fourier Transform
   e.g. http://en.wikipedia.org/wiki/Discrete_Fourier_transform
+  out[k] = (1/N) * sum_n in[n]*exp(i*2pi*k*n/N), done by fft_any in O(N*log(N))
 ****************************************/
 
   int N = in.n_elts; // <in> and <out> are the vectors with n elements: n x 1
-  complex<double> f,mul;
-  double arg;
+  vector< complex<double> > a(in.M,in.M+N);
 
-  for(int k=0;k<N;k++){
+  fft_any(a,1);
 
-    out.M[k] = 0.0;
-    arg = 2.0*M_PI*k/((double)N);
+  double arg = 1.0/((double)N);
+  for(int k=0;k<N;k++){ out.M[k] = a[k]*arg; }
 
-    f = complex<double>(cos(arg),sin(arg));
-    mul = 1.0;
+}
 
-    for(int n=0;n<N;n++){
-      out.M[k] += in.M[n]*mul;
-      mul *= f;
-    }// for j
-  }// for i
+void dft_cols(matrix& in,matrix& out,int dir){
+/***************************************
+  Transforms each column of <in> independently:
+  dir = -1: out.col(j) = dft(in.col(j))
+  dir =  1: out.col(j) = inv_dft(in.col(j))
+  <in> and <out> are n_rows x n_cols
+****************************************/
 
-  arg = 1.0/((double)N);
-  
-  for(k=0;k<N;k++){ out.M[k] *= arg; }
+  int N = in.n_rows;
+  double arg = (dir<0)? 1.0 : 1.0/((double)N);
+  vector< complex<double> > a(N);
+
+  for(int j=0;j<in.n_cols;j++){
+    for(int n=0;n<N;n++){ a[n] = in.M[n*in.n_cols+j]; }
+    fft_any(a,dir);
+    for(int k=0;k<N;k++){ out.M[k*out.n_cols+j] = a[k]*arg; }
+  }// for j
 
 }
 
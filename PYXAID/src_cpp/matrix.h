@@ -41,6 +41,14 @@ public:
   // Copy constructor
   matrix(const matrix& ob);  
 
+#if __cplusplus >= 201103L
+  // Move constructor: takes over the buffer of a temporary (e.g. result of A*B)
+  matrix(matrix&& ob){
+    n_rows = ob.n_rows; n_cols = ob.n_cols; n_elts = ob.n_elts; M = ob.M;
+    ob.n_rows = ob.n_cols = ob.n_elts = 0; ob.M = NULL;
+  }
+#endif
+
   // Destructor
   ~matrix(){ delete [] M; n_rows = n_cols = n_elts = 0;}
 
@@ -61,15 +69,18 @@ public:
   matrix operator/(double num);
   matrix operator/(complex<double> num);
   matrix& operator=(const matrix& ob);
-  matrix operator=(double num);
-  matrix operator=(complex<double> num);
+#if __cplusplus >= 201103L
+  matrix& operator=(matrix&& ob);     // swaps buffers with a temporary instead of copying
+#endif
+  matrix& operator=(double num);
+  matrix& operator=(complex<double> num);
 
 
   friend matrix operator*(const double& f,  const matrix& m1);  // Multiplication of matrix and double;
   friend matrix operator*(const matrix& m1, const double  &f);  // Multiplication of matrix and double;
   friend matrix operator*(const complex<double>& f,  const matrix& m1);  // Multiplication of matrix and double;
   friend matrix operator*(const matrix& m1, const complex<double>  &f);  // Multiplication of matrix and double;
-  friend ostream &operator<<(ostream &strm,matrix ob);
+  friend ostream &operator<<(ostream &strm,const matrix& ob);
   friend istream& operator>>(istream& strm,matrix &ob);
 
 
@@ -102,20 +113,83 @@ public:
 
   // Functions of matrix
   friend matrix exp(matrix& m1,complex<double> scl,double eps);
+  friend matrix exp(matrix& m1,complex<double> scl,double eps,int alg); // alg: 0 - auto, 1 - eigen, 2 - Pade
   friend matrix sin(matrix& m1,complex<double> scl,double eps);
   friend matrix cos(matrix& m1,complex<double> scl,double eps);
   friend matrix pow(matrix& m1,double scl,double eps);
 
 };
 
+
+class hermitian_matrix{
+/****************************************************************
+ Hermitian n x n matrix in packed form: the real diagonal d and
+ the strictly upper triangle u, stored row by row, so that
+ H_ij = u[upper(i,j)] and H_ji = conj(H_ij) for i<j. This takes
+ (n + n*(n-1))*sizeof(double) instead of 2*n*n*sizeof(double)
+ of the full matrix. Loops over i<j run through u sequentially
+****************************************************************/
+public:
+  int n;
+  vector<double> d;              // H_ii
+  vector< complex<double> > u;   // H_ij, i<j
+
+  // Constructors
+  hermitian_matrix(){ n = 0; }
+  hermitian_matrix(int n_){
+    n = n_; d = vector<double>(n,0.0); u = vector< complex<double> >(n*(n-1)/2,complex<double>(0.0,0.0));
+  }
+  hermitian_matrix(const matrix& m);  // packs the diagonal and the upper triangle of m
+
+  // Element access
+  int upper(int i,int j) const { return i*(2*n-i-1)/2 + j - i - 1; } // position of H_ij in u, i<j
+  complex<double> get(int i,int j) const{
+    if(i<j){ return u[upper(i,j)]; }
+    else if(i>j){ return std::conj(u[upper(j,i)]); }
+    return complex<double>(d[i],0.0);
+  }
+  void set(int i,int j,const complex<double>& x){
+    if(i<j){ u[upper(i,j)] = x; }
+    else if(i>j){ u[upper(j,i)] = std::conj(x); }
+    else{ d[i] = x.real(); }
+  }
+
+  void pack(const matrix& m);     // this = m, only the diagonal and the upper triangle of m are read
+  void unpack(matrix& m) const;   // m = this, m is n x n
+
+  // Operations, element-wise as those of matrix
+  hermitian_matrix operator+(const hermitian_matrix& ob) const;
+  hermitian_matrix operator-(const hermitian_matrix& ob) const;
+  hermitian_matrix operator/(double num) const;
+  void operator*=(double f);
+  hermitian_matrix& operator=(double num);   // all elements
+
+  friend hermitian_matrix operator*(const double& f,const hermitian_matrix& m1);
+  friend ostream &operator<<(ostream &strm,const hermitian_matrix& ob);
+};
+
+void axpy(double a,const hermitian_matrix& x,hermitian_matrix& y); // y += a * x
+
+
 void qr(double EPS,int n,matrix& M,vector<double>& Eval); // Compute eigenvalues of M
 void qr(double EPS,int n,matrix& M,vector<double>& Eval,matrix& Evec);  // Computes eigenvalues and eigenvectors of M
 
 void solve_linsys(matrix& C,matrix& D, matrix& X,double eps,int maxiter,double omega);
 void solve_linsys1(matrix& C,matrix& X,double eps,int maxiter,double omega);
 
+void gemm(int nr,int nk,int nc,const complex<double>* A,const complex<double>* B,complex<double>* C); // C = A * B
+void gemm_dot(int nr,int nc,int nk,const complex<double>* A,const complex<double>* B,complex<double>* C); // C = conj(A) * B.T
+void gemm_dot(int nr,int nc,int nk,const complex<float>* A,const complex<float>* B,complex<double>* C);   // summed in double
+// Fused in-place updates - no temporaries are created
+void axpy(double a,const matrix& x,matrix& y);           // y += a * x
+void axpy(const complex<double>& a,const matrix& x,matrix& y); // y += a * x
+void hermitize(matrix& m);                                // m = 0.5*(m + m.H()), m is square
+double hermiticity_error(const matrix& m);                // ||m - m.H()|| / ||m||, Frobenius norms, m is square
+void scale_cols(matrix& m,const matrix& d);               // m = m * d, d is diagonal
+matrix expm_pade(matrix& m1,complex<double> scl);            // exp(m1*scl) for general m1
 void dft(matrix& in,matrix& out);
 void inv_dft(matrix& in,matrix& out);
+void dft_cols(matrix& in,matrix& out,int dir);            // dft (dir=-1) or inv_dft (dir=1) of every column
 
 
 #endif // matrix_h
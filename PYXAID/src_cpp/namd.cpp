@@ -12,19 +12,33 @@
 #include "io.h"
 #include "random.h"
 #include "mytimer_cpp.h"
+#include "fft.h"
 
 /*****************************************************************
   Functions implemented in this file:
 
   void hop(vector<double>& sh_prob,int& hopstate,int numstates)
   void regression(vector<double>& X,vector<double>& Y,int opt,double& a,double& b)
-  double decoherence_rates(vector<double>& x,double dt,std::string rt_dir,int regress_mode)
+  double decoherence_rates(vector<double>& x,double dt,int regress_mode,vector<double>& J)
+  void spectral_density_output(std::string rt_dir,vector<double>& J)
+  void write_decoherence_data(ofstream& out,decoherence_data& dd)
+  int read_decoherence_data(ifstream& in,decoherence_data& dd)
+  void spectral_density_binary(std::string filename,decoherence_data& dd)
+  int read_spectral_density_binary(std::string filename,decoherence_data& dd)
+  void decoherence_cache_write(std::string filename,std::string key,decoherence_data& dd)
+  int decoherence_cache_read(std::string filename,std::string key,decoherence_data& dd)
   void Efield(InputStructure& is,double t,matrix& E,double& Eex)
+  int adaptive_elec_steps(InputStructure& is,vector<ElectronicStructure>& es,int i)
+  void report_elec_steps(std::string filename,int icond,vector<ElectronicStructure>& es)
   void propagate_electronic(InputStructure& is,vector<ElectronicStructure>& es,int i, matrix& rates)
   void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix& rates)
-  void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond)
+  void compute_decoherence_data(InputStructure& is,vector< vector<double> >& E,decoherence_data& dd)
+  void decoherence_data_output(InputStructure& is,int icond,decoherence_data& dd)
+  void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd)
   void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond) 
-  void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond)
+  int surface_hop(InputStructure& is,ElectronicStructure& es,matrix& rates)
+  void run_sh_batch(InputStructure& is, vector<ElectronicStructure>& me_es,matrix& rates,vector<vector<double> >& sh_pops,vector<vector<double> >& se_pops)
+  void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd)
 
 *****************************************************************/
 
@@ -93,16 +107,21 @@ void regression(vector<double>& X,vector<double>& Y,int opt,double& a,double& b)
 
 }
 
-double decoherence_rates(vector<double>& x,double dt,std::string rt_dir,int regress_mode){
+// Energy grid of the spectral density function
+static const double spectral_dE = 0.0025; // spacing for x (energy) axis for spectral density function = 20 cm^-1
+static const int spectral_npoints = 400*5;  // cover 5 eV range of energies
+
+double decoherence_rates(vector<double>& x,double dt,int regress_mode,vector<double>& J){
 /***********************************************
  Computes:
  1) the autocorrelation function of vector x
  Note the size of the autocorr function is 1/2 of 
  the size of vector x
- 2) phonon spectrum (FT of the autocorrelation function)
+ 2) phonon spectrum (FT of the autocorrelation function), returned in J
  3) decoherence time
  
  Expected x - fluctuation of the energy difference between two states
+ Nothing is written here, so it can be called for many pairs in parallel
 ***********************************************/
   int len = x.size();
   int sz = (len%2==0)?(len/2):((len-1)/2);
@@ -115,58 +134,48 @@ double decoherence_rates(vector<double>& x,double dt,std::string rt_dir,int regr
 
   //===== Part 1: Autocorrealtion and decoherence functions ============
 
-  // Normalized autocorrelation functions
-  for(int t=0;t<sz;t++){ 
-    for(int n=0;n<sz;n++){ C[t] += x[n]*x[n+t];  }
-    C[t] /= ((double)sz);
-  }//for t
+  // Normalized autocorrelation functions: C[t] = sum_{n<sz} x[n]*x[n+t] / sz
+  // computed via FFT
+  correlation(x,sz,x,sz,C);
+  for(int t=0;t<sz;t++){  C[t] /= ((double)sz);  }//for t
 
   // Calculate first "cumulants" int_0_t C(t) dt ,for all t
   double sum = 0.0;
-  for(t=0;t<sz;t++){ IC[t] = sum;  sum +=  C[t]*(dt/hbar); }
+  for(int t=0;t<sz;t++){ IC[t] = sum;  sum +=  C[t]*(dt/hbar); }
 
   // Calculate second "cumulants" int_0_t IC(t) dt ,for all t
   sum = 0.0;
-  for(t=0;t<sz;t++){ IIC[t] = sum; sum += IC[t]*(dt/hbar); }
+  for(int t=0;t<sz;t++){ IIC[t] = sum; sum += IC[t]*(dt/hbar); }
 
   // Calculate D(t), see Madrid, et. al
-  for(t=0;t<sz;t++){ D[t] = exp(-IIC[t]); }
+  for(int t=0;t<sz;t++){ D[t] = exp(-IIC[t]); }
 
   // Normalize the autocorrelation function to C[0]
   double nrm = C[0];
-  for(t=0;t<sz;t++){ C[t] /= nrm; }
+  for(int t=0;t<sz;t++){ C[t] /= nrm; }
 
   //===== Part 2: Phonon spectrum (spectral density function) ============
   // Do FT of the normalized autocorrelation function
 
   // Compute spectral density J
-  double dE = 0.0025; // spacing for x (energy) axis for spectral density function = 20 cm^-1
-  int Npoints = 400*5; // cover 5 eV range of energies
-  vector<double> J(Npoints,0.0);
+  double dE = spectral_dE;
+  int Npoints = spectral_npoints;
+  J = vector<double>(Npoints,0.0);
 
-  for(int w=0;w<Npoints;w++){
-    J[w] = 1.0;
+  // J[w] = dt * (1 + 2*sum_{t>0} cos(w*dE*t*dt)*C[t]), all w at once via chirp-z transform
+  vector< complex<double> > Cc(sz,complex<double>(0.0,0.0));
+  vector< complex<double> > Cw;
+  for(int t=1;t<sz;t++){ Cc[t] = C[t]; }
+  chirp_z(Cc,dE*dt,Npoints,Cw);
 
-    for(int t=1;t<sz;t++){
-      double x = (w*dE) * (t*dt);
-      J[w] += 2.0*cos(x)*C[t];
-    }// for t
+  for(int w=0;w<Npoints;w++){
+    J[w] = 1.0 + 2.0*Cw[w].real();
 
     J[w] *= dt;
     J[w] = (J[w]*J[w]/(2.0*M_PI));
 
   }// for w
 
-  // Output D and its model(based on the fitted parameters)
-  ofstream out1((rt_dir+"Spectral_density.txt").c_str(),ios::out);
-  for(w=0;w<Npoints;w++){
-    //out1 << "w(eV)= " << w*dE << " w(cm^-1)= " << w*dE*8065.54468111324 << " J= " << J[w]
-                             //<< " sqrt(J)= " << sqrt(J[w]) << endl;
-    out1 << w*dE << " " << w*dE*8065.54468111324 << " " << J[w]
-                             << " " << sqrt(J[w]) << endl;
-  }
-  out1.close();
-
 
   //===== Part 3: Decoherence times ============
   // In fact we don't even needed to compute D explicitly
@@ -175,7 +184,7 @@ double decoherence_rates(vector<double>& x,double dt,std::string rt_dir,int regr
   // If eps = 0.1 => -ln(eps) = 2.3
   //    eps = 0.01 => -ln(eps) = 4.6
   int first = 1;  // this is correction to avoid recurrences!
-  for(t=0;t<sz;t++){
+  for(int t=0;t<sz;t++){
     if(first){
       if(IIC[t]<2.3){ 
         T.push_back(t*t*dt*dt); 
@@ -205,6 +214,103 @@ double decoherence_rates(vector<double>& x,double dt,std::string rt_dir,int regr
   return sqrt(b);
 }
 
+void spectral_density_output(std::string rt_dir,vector<double>& J){
+// Output the spectral density computed by decoherence_rates
+  double dE = spectral_dE;
+  int Npoints = J.size();
+  ofstream out1((rt_dir+"Spectral_density.txt").c_str(),ios::out);
+  for(int w=0;w<Npoints;w++){
+    //out1 << "w(eV)= " << w*dE << " w(cm^-1)= " << w*dE*8065.54468111324 << " J= " << J[w]
+                             //<< " sqrt(J)= " << sqrt(J[w]) << endl;
+    out1 << w*dE << " " << w*dE*8065.54468111324 << " " << J[w]
+                             << " " << sqrt(J[w]) << endl;
+  }
+  out1.close();
+}
+
+void write_decoherence_data(ofstream& out,decoherence_data& dd){
+// Layout: int nst, int npoints, double dE, nst*nst doubles of rates (row-major), then
+// npoints doubles of J for each pair i<j in the order (0,1),(0,2),...,(1,2),...
+  int nst = dd.nst;
+  int Npoints = (nst>1)? dd.J[1].size() : 0;
+  out.write((char*)&nst,sizeof(int));
+  out.write((char*)&Npoints,sizeof(int));
+  out.write((char*)&dd.dE,sizeof(double));
+  for(int i=0;i<nst;i++){ out.write((char*)&dd.rates[i][0],nst*sizeof(double)); }
+  for(int i=0;i<nst;i++){
+    for(int j=i+1;j<nst;j++){
+      out.write((char*)&dd.J[i*nst+j][0],Npoints*sizeof(double));
+    }
+  }
+}
+
+int read_decoherence_data(ifstream& in,decoherence_data& dd){
+// Read the data written by write_decoherence_data. Returns 1 on success, 0 otherwise
+  int nst,Npoints;
+  in.read((char*)&nst,sizeof(int));
+  in.read((char*)&Npoints,sizeof(int));
+  if(in.fail() || nst<1 || Npoints<0){ return 0; }
+  in.read((char*)&dd.dE,sizeof(double));
+  dd.nst = nst;
+  dd.rates = vector< vector<double> >(nst,vector<double>(nst,0.0));
+  dd.J = vector< vector<double> >(nst*nst);
+  for(int i=0;i<nst;i++){ in.read((char*)&dd.rates[i][0],nst*sizeof(double)); }
+  for(int i=0;i<nst;i++){
+    for(int j=i+1;j<nst;j++){
+      dd.J[i*nst+j] = vector<double>(Npoints,0.0);
+      in.read((char*)&dd.J[i*nst+j][0],Npoints*sizeof(double));
+    }
+  }
+  return !in.fail();
+}
+
+void spectral_density_binary(std::string filename,decoherence_data& dd){
+// Output the rates and all spectral densities of one initial condition in a single binary file,
+// see write_decoherence_data for the layout
+  ofstream out(filename.c_str(),ios::out|ios::binary);
+  write_decoherence_data(out,dd);
+  out.close();
+}
+
+int read_spectral_density_binary(std::string filename,decoherence_data& dd){
+// Read the file written by spectral_density_binary. Returns 1 on success, 0 if there is no such file
+  ifstream in(filename.c_str(),ios::in|ios::binary);
+  if(!in.is_open()){ return 0; }
+  int ok = read_decoherence_data(in,dd);
+  in.close();
+  return ok;
+}
+
+void decoherence_cache_write(std::string filename,std::string key,decoherence_data& dd){
+// Cache file of the decoherence rates: int length of the key, the key - the text that describes the input
+// the data have been computed from - and then the data as in spectral_density_binary
+  int len = key.size();
+  ofstream out(filename.c_str(),ios::out|ios::binary);
+  out.write((char*)&len,sizeof(int));
+  out.write(key.c_str(),len);
+  write_decoherence_data(out,dd);
+  out.close();
+}
+
+int decoherence_cache_read(std::string filename,std::string key,decoherence_data& dd){
+// Read the file written by decoherence_cache_write. Returns 1 on success, 0 if there is no such file and
+// -1 if the file has been written for a different key or can not be read. dd is only changed on success
+  ifstream in(filename.c_str(),ios::in|ios::binary);
+  if(!in.is_open()){ return 0; }
+
+  int ok = -1;
+  int len = 0;
+  in.read((char*)&len,sizeof(int));
+  if(!in.fail() && len==(int)key.size()){
+    std::string file_key(len,' ');
+    if(len>0){ in.read(&file_key[0],len); }
+    decoherence_data tmp;
+    if(!in.fail() && file_key==key && read_decoherence_data(in,tmp)){  dd = tmp;  ok = 1;  }
+  }
+  in.close();
+  return ok;
+}
+
 void Efield(InputStructure& is,double t,matrix& E,double& Eex){
 // Field modulation protocol
 // is - input parameters
@@ -312,9 +418,101 @@ void Efield(InputStructure& is,double t,matrix& E,double& Eex){
 }
 
 
+int adaptive_elec_steps(InputStructure& is,vector<ElectronicStructure>& es,int i){
+/***********************************************
+ Chooses the number of electronic steps for nuclear step i
+ by step doubling: one Trotter step of size dt is compared to
+ two steps of size dt/2, starting from the current coefficients.
+ The propagator is second order, so the local error of the 
+ two-step result is ~ |C2 - C1|/3. The step is halved until this
+ error is below elec_dt_tol, and is doubled back when the error
+ falls below elec_dt_tol/8. The coefficients are left unchanged.
+ The choice and its statistics are kept in es[i].adapt, the search
+ starts from the choice made for step i-1 of the same trajectory
+************************************************/
+  adaptive_step_data& ad = es[i].adapt;
+  int nmin = (int)ceil(is.nucl_dt/is.elec_dt_max - 1e-8); if(nmin<1){ nmin = 1; }
+  int nmax = (int)(is.nucl_dt/is.elec_dt_min + 1e-8);     if(nmax<nmin){ nmax = nmin; }
+
+  // Start from the previous nuclear step (from elec_dt on the first one)
+  int n = (i>0)? es[i-1].adapt.nel : 0;
+  if(n==0){ n = is.nucl_dt/is.elec_dt; }
+  if(n<nmin){ n = nmin; }
+  if(n>nmax){ n = nmax; }
+
+  double Eex = 0.0;
+  matrix Ef(3,1);
+  Efield(is,i*is.nucl_dt,Ef,Eex);
+
+  matrix C0(*es[i].Ccurr);
+  double err;
+
+  while(1){
+    double dt = is.nucl_dt/((double)n);
+
+    es[i].propagate_coefficients(dt,Ef);
+    matrix C1(*es[i].Ccurr);
+    *es[i].Ccurr = C0;
+
+    es[i].propagate_coefficients(0.5*dt,Ef);
+    es[i].propagate_coefficients(0.5*dt,Ef);
+
+    err = 0.0;
+    for(int k=0;k<es[i].num_states;k++){ 
+      double d = abs(es[i].Ccurr->M[k] - C1.M[k]);
+      if(d>err){ err = d; }
+    }
+    err /= 3.0;
+    *es[i].Ccurr = C0;
+
+    if(err>is.elec_dt_tol && 2*n<=nmax){ n *= 2; ad.refine++; }
+    else{ break; }
+  }
+  // The smallest allowed step is used anyway, such cases are counted and reported by report_elec_steps
+  if(err>is.elec_dt_tol){ ad.unconverged++; }
+  // Local error of a second order scheme scales as dt^3
+  else if(err<0.125*is.elec_dt_tol && n/2>=nmin){ n /= 2; }
+
+  ad.nel = n;
+  if(ad.calls==0 || n<ad.nmin){ ad.nmin = n; }
+  if(ad.calls==0 || n>ad.nmax){ ad.nmax = n; }
+  ad.calls++;
+  ad.elec += n;
+
+  return n;
+}
+
+void report_elec_steps(std::string filename,int icond,vector<ElectronicStructure>& es){
+// Appends the statistics of the adaptive electronic time step of initial condition icond to file filename
+  long calls = 0, elec = 0, refine = 0, unconverged = 0;
+  int nmin = 0, nmax = 0;
+  int sz = es.size();
+  for(int i=0;i<sz;i++){
+    adaptive_step_data& ad = es[i].adapt;
+    if(ad.calls==0){ continue; }
+    if(calls==0 || ad.nmin<nmin){ nmin = ad.nmin; }
+    if(calls==0 || ad.nmax>nmax){ nmax = ad.nmax; }
+    calls += ad.calls;  elec += ad.elec;  refine += ad.refine;  unconverged += ad.unconverged;
+  }
+  if(calls==0){ return; }
+
+  ofstream out(filename.c_str(),ios::app);
+  out<<"  Adaptive electronic time step, icond = "<<icond<<":\n";
+  out<<"    nuclear steps = "<<calls<<"  electronic steps = "<<elec<<"  refinements = "<<refine<<endl;
+  out<<"    electronic steps per nuclear step: average = "<<elec/((double)calls)
+     <<"  min = "<<nmin<<"  max = "<<nmax<<endl;
+  if(unconverged>0){
+    out<<"    Warning: elec_dt_tol was not reached with the smallest allowed step in "<<unconverged<<" nuclear steps\n";
+    cout<<"Warning: elec_dt_tol was not reached with the smallest allowed step in "<<unconverged<<" nuclear steps, see "<<filename<<endl;
+  }
+  out<<endl;
+  out.close();
+}
+
 void propagate_electronic(InputStructure& is,vector<ElectronicStructure>& es,int i, matrix& rates){
 
   int nel = is.nucl_dt/is.elec_dt; // Number of electronic iterations per 1 nuclear
+  double dt = is.elec_dt;          // electronic time step
   int sz = es.size();              // Number of nuclear iterations (ionic steps)
   double tim;                      // time
   double Eex = 0.0;                // bias due to photons
@@ -326,22 +524,24 @@ void propagate_electronic(InputStructure& is,vector<ElectronicStructure>& es,int
   // May be missing some features for integrator != 0
 
   if(is.integrator==0){
+    if(is.elec_dt_adaptive){  nel = adaptive_elec_steps(is,es,i); dt = is.nucl_dt/nel; }
+
     for(int j=0;j<nel;j++){ 
-      tim = (i*is.nucl_dt + j*is.elec_dt);
+      tim = (i*is.nucl_dt + j*dt);
       // Compute field
       Efield(is,tim,Ef,Eex);
 
       // Propagate coefficients
-      if(is.decoherence==5){   es[i].propagate_coefficients( is.elec_dt,Ef,rates);      } // CPF
-      else{                    es[i].propagate_coefficients( is.elec_dt,Ef );       }
+      if(is.decoherence==5){   es[i].propagate_coefficients( dt,Ef,rates);      } // CPF
+      else{                    es[i].propagate_coefficients( dt,Ef );       }
 
       // Update time
-      es[i].t_m[0] += is.elec_dt; 
+      es[i].t_m[0] += dt; 
 
       // Update hopping probabilities
-      if(is.sh_algo==0){ es[i].update_hop_prob_fssh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
-      else if(is.sh_algo==1){  es[i].update_hop_prob_gfsh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
-      else if(is.sh_algo==2){  es[i].update_hop_prob_mssh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+      if(is.sh_algo==0){ es[i].update_hop_prob_fssh(dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+      else if(is.sh_algo==1){  es[i].update_hop_prob_gfsh(dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+      else if(is.sh_algo==2){  es[i].update_hop_prob_mssh(dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
 
 
     }// for j
@@ -397,6 +597,36 @@ void propagate_electronic(InputStructure& is,vector<ElectronicStructure>& es,int
 
     }//j
   }
+  else if(is.integrator==4){
+    // Linear interpolation of H between this and the next nuclear steps
+    if(i<(sz-1)){  *es[i].dHdt = (*es[i+1].Hcurr-*es[i].Hcurr)/is.nucl_dt; }
+    else if(i==(sz-1)) { *es[i].dHdt = (*es[i].Hcurr - *es[i-1].Hcurr)/is.nucl_dt; }
+    // Now propagate coefficients
+    for(int j=0;j<nel;j++){
+      tim = (i*is.nucl_dt + j*is.elec_dt);
+      Efield(is,tim,Ef,Eex);
+
+      if(is.debug_flag==1 && j==0){
+        // Check against integrator 2 with H taken at the middle of the electronic step:
+        // the two agree up to O(elec_dt^3) and coincide for constant H
+        ElectronicStructure es2(es[i]);
+        axpy(0.5*is.elec_dt,*es[i].dHdt,*es2.Hcurr);
+        es2.propagate_coefficients2(is.elec_dt,Ef);
+        es[i].propagate_coefficients4(j*is.elec_dt,is.elec_dt);
+
+        double d = 0.0;
+        for(int k=0;k<es[i].num_states;k++){ d = max(d,abs(es[i].Ccurr->M[k] - es2.Ccurr->M[k])); }
+        cout<<"Nuclear step "<<i<<": max|C(integrator 4) - C(integrator 2)| after one electronic step = "<<d<<endl;
+      }
+      else{ es[i].propagate_coefficients4(j*is.elec_dt,is.elec_dt); }
+
+      // Update hopping probabilities
+      if(is.sh_algo==0){ es[i].update_hop_prob_fssh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+      else if(is.sh_algo==1){  es[i].update_hop_prob_gfsh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+      else if(is.sh_algo==2){  es[i].update_hop_prob_mssh(is.elec_dt,is.boltz_flag,is.Temp,Ef,Eex,rates);  }
+
+    }//j
+  }
 
 }
 
@@ -408,6 +638,7 @@ void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix&
   for(int i=0;i<sz;i++){     // Nuclear iterations - MD trajectory length
 
     if(i>0){   es[i] << es[i-1]; }
+    es[i].hop_all_rows = 1;  // the state is not known yet, so we need all rows
     es[i].init_hop_prob1();
     propagate_electronic(is,es,i,rates); // it also updates the hopping probabilities
 
@@ -422,7 +653,7 @@ void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix&
 */
 
 
-//    es[i].update_populations();
+    es[i].update_populations();
     // Calculate the probabilities off all states and hopping probabilities
 //    es[i].update_hop_prob(is.nucl_dt,is.boltz_flag,is.Temp);
 
@@ -432,15 +663,15 @@ void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix&
       cout<<"After namd nuclear iteration "<<i<<" populations of all considered states are:"<<endl;
       for(int j=0;j<es[i].num_states;j++){
         for(int k=0;k<es[i].num_states;k++){
-          cout<<"a("<<j<<","<<k<<") = "<<es[i].A->M[j*es[i].num_states+k].real()<<" + "<<es[i].A->M[j*es[i].num_states+k].imag()<<"i"<<" ";
+          cout<<"a("<<j<<","<<k<<") = "<<es[i].density_matrix().M[j*es[i].num_states+k].real()<<" + "<<es[i].density_matrix().M[j*es[i].num_states+k].imag()<<"i"<<" ";
         }
         cout<<endl;
       }
       cout<<"Hopping probabilities:\n";
-      for(j=0;j<es[i].num_states;j++){ cout<<"P( "<<es[i].curr_state<<" --> "<<j<<" )= "<<setprecision(10)<<es[i].g[es[i].curr_state*es[i].num_states+j]<<endl; }
+      for(int j=0;j<es[i].num_states;j++){ cout<<"P( "<<es[i].curr_state<<" --> "<<j<<" )= "<<setprecision(10)<<es[i].g[es[i].curr_state*es[i].num_states+j]<<endl; }
       cout<<"Coefficients: \n";
       double norm = 0.0;
-      for(j=0;j<es[i].num_states;j++){ cout<<"c["<<j<<"] = "<<es[i].Ccurr->M[j].real()<<" + "<<es[i].Ccurr->M[j].imag()<<"i \n"; norm += (conj(es[i].Ccurr->M[j])*es[i].Ccurr->M[j]).real(); }
+      for(int j=0;j<es[i].num_states;j++){ cout<<"c["<<j<<"] = "<<es[i].Ccurr->M[j].real()<<" + "<<es[i].Ccurr->M[j].imag()<<"i \n"; norm += (conj(es[i].Ccurr->M[j])*es[i].Ccurr->M[j]).real(); }
       cout<<"Norm = "<<norm<<endl;
     }
 
@@ -448,38 +679,73 @@ void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix&
 }
 
 
-void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond){
-  // The function for computation of the decoherence rates matrix
-
-  Timer timer("run_deco_rates()");
+void compute_decoherence_data(InputStructure& is,vector< vector<double> >& E,decoherence_data& dd){
+  // The function for computation of the decoherence rates matrix and the spectral densities
+  // E[t][i] - energy of state i at nuclear step t
+  // The energy gap fluctuation of pair (j,i) is that of (i,j) with opposite sign, so the 
+  // autocorrelation function, spectral density and the rate are the same: we only compute i<j.
+  // The pairs are independent and are distributed among threads
 
-  cout<<"Entering run_decoherence_rates...\n";
+  int sz = E.size();                  // Number of nuclear iterations (ionic steps)
+  int N = E[0].size();
 
-  int sz = me_es.size();              // Number of nuclear iterations (ionic steps)
-  int N = me_es[0].num_states;
-  matrix rij(N,N);
-  ofstream out((is.scratch_dir+"/decoherence_rates_icond"+int2string(icond)+".txt").c_str(),ios::out);
+  dd.nst = N;
+  dd.dE = spectral_dE;
+  dd.rates = vector< vector<double> >(N,vector<double>(N,0.0));
+  dd.J = vector< vector<double> >(N*N);
 
+  // List of pairs i<j
+  vector<int> pi,pj;
   for(int i=0;i<N;i++){
-    for(int j=0;j<N;j++){
-      if(i==j){ rij.M[i*N+j]=0.0; }
-      else{
-        // First lets extract the energy differences of the levels i and j along the trajectory
-        vector<double> Eij(sz,0.0);
-        double dEij,ave_dEij; ave_dEij = 0.0;
-        for(int t=0;t<sz;t++){
-          dEij = me_es[t].Hcurr->M[i*N+i].real() - me_es[t].Hcurr->M[j*N+j].real();
-          Eij[t] = dEij;
-          ave_dEij += dEij;
-        }
-        ave_dEij /= ((double)sz);
-        // Subtract the average value
-        for(t=0;t<sz;t++){ Eij[t] -= ave_dEij; }
+    for(int j=i+1;j<N;j++){ pi.push_back(i); pj.push_back(j); }
+  }
+  int npairs = pi.size();
+
+  #pragma omp parallel for schedule(dynamic)
+  for(int p=0;p<npairs;p++){
+    int i = pi[p];
+    int j = pj[p];
+
+    // First lets extract the energy differences of the levels i and j along the trajectory
+    vector<double> Eij(sz,0.0);
+    double dEij,ave_dEij; ave_dEij = 0.0;
+    for(int t=0;t<sz;t++){
+      dEij = E[t][i] - E[t][j];
+      Eij[t] = dEij;
+      ave_dEij += dEij;
+    }
+    ave_dEij /= ((double)sz);
+    // Subtract the average value
+    for(int t=0;t<sz;t++){ Eij[t] -= ave_dEij; }
+
+    // Compute the decoherence rate for pair i,j
+    dd.rates[i][j] = decoherence_rates(Eij,is.nucl_dt,is.regress_mode,dd.J[i*N+j]);
+    dd.rates[j][i] = dd.rates[i][j];
+  }// for p
+
+}
+
+void decoherence_data_output(InputStructure& is,int icond,decoherence_data& dd){
+  // Write the decoherence rates and (optionally) the spectral densities for given initial condition
+
+  int N = dd.nst;
 
-        // Compute the decoherence rate for pair i,j
-        rij.M[i*N+j] = decoherence_rates(Eij,is.nucl_dt,is.scratch_dir+"/icond"+int2string(icond)+"pair"+int2string(i)+"_"+int2string(j),is.regress_mode);
+  if(is.spectral_output==1){
+    spectral_density_binary(is.scratch_dir+"/spectral_density_icond"+int2string(icond)+".bin",dd);
+  }
+  else if(is.spectral_output==2){
+    for(int i=0;i<N;i++){
+      for(int j=i+1;j<N;j++){
+        spectral_density_output(is.scratch_dir+"/icond"+int2string(icond)+"pair"+int2string(i)+"_"+int2string(j),dd.J[i*N+j]);
+        spectral_density_output(is.scratch_dir+"/icond"+int2string(icond)+"pair"+int2string(j)+"_"+int2string(i),dd.J[i*N+j]);
       }
-      out<<rij.M[i*N+j].real()<<" ";
+    }
+  }
+
+  ofstream out((is.scratch_dir+"/decoherence_rates_icond"+int2string(icond)+".txt").c_str(),ios::out);
+  for(int i=0;i<N;i++){
+    for(int j=0;j<N;j++){
+      out<<dd.rates[i][j]<<" ";
     }// for j
     out<<"\n";
   }// for i
@@ -487,6 +753,30 @@ void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_e
 
 }
 
+void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd){
+  // The function for computation of the decoherence rates matrix from the window of given initial condition
+  // The rates and the spectral densities are stored in dd for the subsequent NA-MD run
+
+  Timer timer("run_deco_rates()");
+
+  cout<<"Entering run_decoherence_rates...\n";
+
+  int sz = me_es.size();              // Number of nuclear iterations (ionic steps)
+  int N = me_es[0].num_states;
+
+  vector< vector<double> > E(sz,vector<double>(N,0.0));
+  for(int t=0;t<sz;t++){
+    for(int i=0;i<N;i++){ E[t][i] = me_es[t].Hcurr->d[i]; }
+  }
+
+  compute_decoherence_data(is,E,dd);
+
+  timer.Start("run_deco_rates() output");
+  decoherence_data_output(is,icond,dd);
+  timer.Stop();
+
+}
+
 
 void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond){
 
@@ -513,8 +803,8 @@ void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_s
     out<<"time "<<i<<" ";
     double tot = 0.0;
     for(int j=0;j<me_es[i].num_states;j++){
-      out<<"P("<<j<<")= "<<setprecision(10)<<me_es[i].A->M[j*me_es[i].num_states+j].real()<<"  ";
-      tot += me_es[i].A->M[j*me_es[i].num_states+j].real();
+      out<<"P("<<j<<")= "<<setprecision(10)<<me_es[i].population(j)<<"  ";
+      tot += me_es[i].population(j);
     }
     out<<"Total= "<<tot<<endl;
   }
@@ -525,7 +815,7 @@ void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_s
   int curr_state;
   double** sh_pops; // sh_pops[t][i] = population at state i at time t
   sh_pops = new double*[is.namdtime];
-  for(i=0;i<sz;i++){
+  for(int i=0;i<sz;i++){
     sh_pops[i] = new double[me_es[i].num_states];
     for(int j=0;j<me_es[i].num_states;j++){  sh_pops[i][j] = 0.0;  }// j
   }// i
@@ -533,7 +823,7 @@ void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_s
   // Do the hops
   for(int n=0;n<is.num_sh_traj;n++){
     curr_state = me_es[0].curr_state;
-    for(i=0;i<sz;i++){
+    for(int i=0;i<sz;i++){
       hop(me_es[i].g,curr_state,me_es[i].num_states);
       sh_pops[i][curr_state] += 1.0;
     }// for namdtime
@@ -541,7 +831,7 @@ void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_s
 
   outfile = is.scratch_dir+"/out"+int2string(icond);
   out.open(outfile.c_str(),ios::out);
-  for(i=0;i<sz;i++){
+  for(int i=0;i<sz;i++){
     out<<"time "<<i<<" ";
     for(int j=0;j<me_es[0].num_states;j++){
       sh_pops[i][j] = sh_pops[i][j]/((double)is.num_sh_traj);
@@ -551,12 +841,129 @@ void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_s
   }
   out.close();
 
-  for(i=0;i<sz;i++){ delete [] sh_pops[i]; }
+  for(int i=0;i<sz;i++){ delete [] sh_pops[i]; }
   delete [] sh_pops;
 
 }
 
-void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond){
+int surface_hop(InputStructure& is,ElectronicStructure& es,matrix& rates){
+/***********************************************
+ Hops (or decoherence events) of one trajectory at the end of the 
+ nuclear step, with the hopping probabilities es.g accumulated by 
+ propagate_electronic. Returns 1 if es.curr_state is the new state
+ of the trajectory, 0 if there is no surface hopping (CPF)
+************************************************/
+  int nst = es.num_states;
+  int res = 1;
+
+  es.update_populations();
+
+  if(is.decoherence==0){  // FSSH
+    hop(es.g,es.curr_state,nst);
+  }
+  else if(is.decoherence==1){  // DISH - currently any value >0
+    if(is.dish_events){  es.check_decoherence_events(is.nucl_dt,is.boltz_flag,is.Temp,rates,is.dish_pop_tol); }
+    else{  es.check_decoherence(is.nucl_dt,is.boltz_flag,is.Temp,rates); }
+  }// decoherence == 1
+
+  else if(is.decoherence==2 || is.decoherence==3 || is.decoherence==4){  // NAC scaling
+    hop(es.g,es.curr_state,nst);
+  }// decoherence == 2
+  else if(is.decoherence==5){  // CPF
+   // Nothing to do here, because it is MF theory
+    res = 0;
+  }
+  else if(is.decoherence==6){  // 
+    int st_before = es.curr_state;
+
+    hop(es.g,es.curr_state,nst);
+
+    // Collapse WFC
+    if(st_before!=es.curr_state){ // Hop has happened - collapse wfc
+
+      es.t_m[0] = 0.0;
+
+      double argg = M_PI*uniform(-1.0,1.0);
+      *es.Ccurr  = 0.0;
+       es.Ccurr->M[es.curr_state] = complex<double>( cos(argg), sin(argg) );          
+    }
+
+  }// is.decoherence==6
+  else{ res = 0; }
+
+  return res;
+}
+
+void run_sh_batch(InputStructure& is, vector<ElectronicStructure>& me_es,matrix& rates,
+                  vector<vector<double> >& sh_pops,vector<vector<double> >& se_pops){
+/***********************************************
+ Same as the loop over trajectories in run_namd1, but is.sh_batch 
+ trajectories at a time: for each nuclear step the coefficients of 
+ all trajectories of the batch are propagated together (integrator 0, 
+ FSSH probabilities), then each trajectory hops (or decoheres) in turn.
+ The state of each trajectory between nuclear steps (coefficients, 
+ current state, DISH times) is kept in traj[k]. The random numbers 
+ are drawn in a different order than in the serial loop.
+************************************************/
+  int i,j,k;
+  int nel = is.nucl_dt/is.elec_dt; // Number of electronic iterations per 1 nuclear
+  double dt = is.elec_dt;          // electronic time step
+  int sz = me_es.size();           // Number of nuclear iterations (ionic steps)
+  int nst = me_es[0].num_states;   // Number of electronic states
+  int init_state = me_es[0].curr_state;
+  double tim;
+  double Eex = 0.0;
+  matrix Ef(3,1);
+
+  for(int n0=0;n0<is.num_sh_traj;n0+=is.sh_batch){
+    int K = is.num_sh_traj - n0;  if(K>is.sh_batch){ K = is.sh_batch; }
+
+    me_es[0].set_state(init_state);
+    for(j=0;j<nst;j++){ me_es[0].t_m[j] = 0.0; } // Times since last hop/decoherence event, all states
+    me_es[0].reset_decoherence_events();
+
+    vector<ElectronicStructure> traj(K,me_es[0]);
+    TrajectoryBatch b(nst,K);
+    for(k=0;k<K;k++){ b.set(k,*traj[k].Ccurr,traj[k].curr_state); }
+
+    // Loop over time
+    for(i=0;i<sz;i++){
+
+      // Solve TD-SE for i-th time step, for all trajectories
+      b.init_hop_prob();
+      for(j=0;j<nel;j++){
+        tim = (i*is.nucl_dt + j*dt);
+        Efield(is,tim,Ef,Eex);
+        me_es[i].propagate_coefficients(dt,Ef,b);
+        me_es[i].update_hop_prob_fssh(dt,is.Temp,Ef,Eex,b);
+      }// for j
+
+      // Hops, one trajectory at a time
+      for(k=0;k<K;k++){
+        me_es[i] << traj[k];
+        b.get(k,*me_es[i].Ccurr);
+        for(j=0;j<nel;j++){ me_es[i].t_m[0] += dt; }  // as in propagate_electronic
+
+        me_es[i].init_hop_prob1();
+        int cs = me_es[i].curr_state;
+        for(j=0;j<nst;j++){ me_es[i].g[cs*nst+j] = b.g[k*nst+j]; }
+
+        surface_hop(is,me_es[i],rates);
+
+        // Accumulate SE and SH probabilities for all states
+        sh_pops[i][me_es[i].curr_state] += 1.0;
+        for(j=0;j<nst;j++){ se_pops[i][j] += me_es[i].population(j); }
+
+        traj[k] << me_es[i];
+        b.set(k,*me_es[i].Ccurr,me_es[i].curr_state);
+      }// for k
+
+    }// namdtime
+  }// for batches
+
+}
+
+void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd){
 // This version is different from run_namd function in that it does not separate solving TD-SE and computation
 // of the surface hopping probabilities. This is because here we inlcude decoherence effects, which effectively
 // modify wavefunction (TD-SE solution) along the trajectories stochastically, so it is not possible to separate.
@@ -580,301 +987,158 @@ void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_
   vector<vector<double> > sh_pops(sz,tmp); sh_pops[0][curr_state] = 0.0;
   vector<vector<double> > se_pops(sz,tmp); se_pops[0][curr_state] = 0.0;
 
+  // Statistics of the adaptive electronic time step are collected for this initial condition only
+  for(i=0;i<sz;i++){ me_es[i].adapt.reset(); }
+
   // Decoherence stuff
-  vector< vector<double> > r_ij;
   vector< vector<double> > z(nst,std::vector<double>(nst,0.0)); // 2D matrix with all components set to 0.0
 
-  vector<vector<double> > E0(nst,vector<double>(nst,0.0));// average
-  vector<vector<double> > d2E_av(nst,vector<double>(nst,0.0)); // average fluctuation of i-j pair
-  vector<vector<vector<double> > > d2E(sz,vector<vector<double> >(nst,vector<double>(nst,0.0)));//fluctuation
   matrix rates(nst,nst);
 
   if(is.decoherence>0){
-    cout<<"Reading decoherence rate matrix for this initial condition...\n";
-    std::string filename = is.scratch_dir+"/decoherence_rates_icond"+int2string(icond)+".txt";
-    cout<<"Expected filename is: "<<filename<<endl;
-
-    ifstream in;
-    in.open(filename.c_str(),ios::in);
-    if(in.is_open()){  cout<<"Reading the input from file "<<filename<<endl; }
-    else{ cout<<"Error: Can not open file "<<filename<<". Check if this file exists\n"; }
-    in.close();
+    // Decoherence rates computed by run_decoherence_rates for this initial condition
+    rates = matrix(dd.rates,z);
 
-    file2matrix(filename,r_ij);
-    rates = matrix(r_ij,z);
 
+    if(is.decoherence==2 || is.decoherence==3 || is.decoherence==4){ // NAC scaling
+      // The off-diagonal elements are scaled as H_ij(t) *= F_ij(t), i<j (H_ji = conj(H_ij) is not stored).
+      // The pairs are done one at a time: the constants that depend only on the pair are computed
+      // once, then the factors for all times are evaluated and applied in one pass over the trajectory
 
-    if(is.decoherence==2){ // NAC scaling
+      int i,j,t;
 
-      std::string filename = is.scratch_dir+"/scaling_factors_icond"+int2string(icond)+".txt";
-      ofstream out(filename.c_str(),ios::out);
+      vector<double> g(sz,0.0);  // energy gap of the pair along the trajectory
+      vector<double> f(sz,1.0);  // scaling factors of the pair
 
-      int i,j,t;
+      // Only with scaling_output: factors and gaps of all pairs, Fout[upper(i,j)*sz+t], dEout - same layout
+      vector<double> Fout, dEout;
+      if(is.scaling_output){  Fout = vector<double>(nst*(nst-1)/2*sz,0.0);  dEout = Fout; }
 
-      // Compute means
       for(i=0;i<nst;i++){
-        for(j=0;j<nst;j++){
-          for(t=0;t<sz;t++){
-            E0[i][j] += (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real());
-          }// for t
-          E0[i][j] /= ((double)sz);
-        }// for j
-      }// for i
+        for(j=i+1;j<nst;j++){
+          int ij = me_es[0].Hcurr->upper(i,j);
 
-      // Compute average fluctuations
-      for(i=0;i<nst;i++){
-        for(j=0;j<nst;j++){
+          double E0 = 0.0;  // average gap
           for(t=0;t<sz;t++){
-            double de = ((me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real()) - E0[i][j]);
-
-            d2E_av[i][j] += de*de;
+            g[t] = (me_es[t].Hcurr->d[i] - me_es[t].Hcurr->d[j]);
+            E0 += g[t];
           }// for t
-          d2E_av[i][j] = sqrt(d2E_av[i][j]/((double)sz));
-          
-        }// for j
-      }// for i
-
-
-
-      for(t=0;t<sz;t++){
-
-        out<<"t= "<<t<<"  ";
-        // Scale Hamiltonian (off-diagonal elements)
-        for(i=0;i<nst;i++){
-          for(j=0;j<nst;j++){
-            if(i!=j){
-              // My original version
-//              double dEij = (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real()) - E0[i][j]; 
-              // Testing Oleg's suggestion
-              double dEij = d2E_av[i][j];
-              double tau = 1000.0; // 1 ps
-              if(rates.M[i*nst+j].real()>0.0){
-                tau = (1.0/rates.M[i*nst+j].real());
-              }
-              double x = 0.5*fabs(dEij * tau / hbar);
-              double F = (x/sqrt(M_PI)) * exp(-x*x);
-              F = sqrt(F);
-
-              me_es[t].Hcurr->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hprev->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hnext->M[i*nst+j] *= F;  // scale NAC
-
-              out<<" dE("<<i<<","<<j<<")= "<<dEij<<" F= "<<F<<" ";
-            }// i!=j
-          }// for j
-        }// for i
-        out<<endl;
-      }// for t
-      out.close();
-    }//is.decoherence == 2
+          E0 /= ((double)sz);
+          double d2E_av = 0.0;  // average fluctuation of the gap
 
+          double tau = 1000.0; // 1 ps
+          if(rates.M[i*nst+j].real()>0.0){
+            tau = (1.0/rates.M[i*nst+j].real());
+          }
 
-    if(is.decoherence==3){  // NAC scaling - spectral density variant
+          if(is.decoherence==2){
+            // Average fluctuation of the gap (Oleg's suggestion) - the factor is the same for all times
+            for(t=0;t<sz;t++){
+              double de = g[t] - E0;
+              d2E_av += de*de;
+            }// for t
+            d2E_av = sqrt(d2E_av/((double)sz));
 
-      std::string filename = is.scratch_dir+"/scaling_factors_icond"+int2string(icond)+".txt";
-      ofstream out(filename.c_str(),ios::out);
+            double x = 0.5*fabs(d2E_av * tau / hbar);
+            double Fij = (x/sqrt(M_PI)) * exp(-x*x);
+            Fij = sqrt(Fij);
 
-      int i,j,t;
+            for(t=0;t<sz;t++){ f[t] = Fij; }
+          }// decoherence == 2
 
-      // Compute means
-      for(i=0;i<nst;i++){
-        for(j=0;j<nst;j++){
-          for(t=0;t<sz;t++){
-            E0[i][j] += (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real()); 
-          }// for t
-          E0[i][j] /= ((double)sz);
-        }// for j
-      }// for i
-     
-      
-      // Read in the spectral density J
-      double dE = 0.0025; // spacing for x (energy) axis for spectral density function = 20 cm^-1
-      int Npoints = 400*5; // cover 5 eV range of energies
-      vector< vector<vector<double> > > J(nst, vector< vector<double> >(nst,vector<double>(Npoints,0.0)));
+          else if(is.decoherence==3){
+            // Spectral density variant: spectral densities computed by run_decoherence_rates for this initial condition
+            vector<double>& J = dd.spectral_density(i,j);
+            int Npoints = J.size();
+            double dE = dd.dE;
 
-      for(i=0;i<nst;i++){
-        for(j=0;j<nst;j++){
-          if(i!=j){
-    
-            cout<<"Reading spectral density for this initial condition...\n";
-            std::string filename = is.scratch_dir+"/icond"+int2string(icond)+"pair"+int2string(i)+"_"+int2string(j)+"Spectral_density.txt";
-            cout<<"Expected filename is: "<<filename<<endl;
-
-            ifstream in;
-            in.open(filename.c_str(),ios::in);
-            if(in.is_open()){  cout<<"Reading the input from file "<<filename<<endl; }
-            else{ cout<<"Error: Can not open file "<<filename<<". Check if this file exists\n"; }
-            in.close();
-
-            // Reading spectral density for given pair, storing data in arrays G (gaps) and J (spectral dens.)
-            vector<std::string> lines;
-            vector<double> G(Npoints,0.0);
-            vector<double> J(Npoints,0.0);
-            read_file(filename, 0, lines);
-
-            vector<std::string> line_tokens;
-            double sumJ = 0.0;
-            for(int w=0;w<Npoints;w++){ 
-              split_line(lines[w],line_tokens);
-              G[w] = atof(line_tokens[1].c_str());        
-              J[w] = atof(line_tokens[5].c_str());
-              sumJ += J[w];
-              line_tokens.clear();
-              
-            }// for w
-
-            // Now we are ready to scale the gap for i->j transition for all times
             for(t=0;t<sz;t++){
-        out<<"t= "<<t<<"  ";
-
-              double dEij = (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real());
-
-//              int indx = floor((dEij - 0.0)/dE); 
-//              double fra = (dEij - G[indx]);
-
-//              double scl = J[indx] + fra*(J[indx+1] - J[indx])/(G[indx+1] - G[indx]);
-//              double scl = J[indx]/sumJ;  // density of vibronic states at given gap
-              double fluct = (dEij - E0[i][j]);
+              double fluct = (g[t] - E0);
               int indx = floor((fabs(fluct)-0.0)/dE);
+              if(indx>=Npoints){ indx = Npoints-1; } // gaps beyond the tabulated range
               double scl = J[indx]* fluct*fluct/(hbar*hbar);
 
               if(scl<0.0){ scl = 0.0; }
 
-              scl = sqrt(scl);
-
-              me_es[t].Hcurr->M[i*nst+j] *= scl;  // scale NAC
-              me_es[t].Hprev->M[i*nst+j] *= scl;  // scale NAC
-              me_es[t].Hnext->M[i*nst+j] *= scl;  // scale NAC
-
-              out<<" dE("<<i<<","<<j<<")= "<<dEij<<" F= "<<scl<<" ";
-
-        out<<endl;
+              f[t] = sqrt(scl);
             }// for t
-
-
-          }// i!=j
-        }// for j
-      }// for i
-
-      out.close();
-
-
-    }// is.decoherence == 3
-
-    if(is.decoherence==4){ // NAC scaling (decoherence==2) but with extrapolation
-
-      std::string filename = is.scratch_dir+"/scaling_factors_icond"+int2string(icond)+".txt";
-      ofstream out(filename.c_str(),ios::out);
-
-      double maxx = sqrt(0.5);
-      double maxf = exp(-0.25)/pow(2.0*M_PI, 0.25);
-
-      for(int t=0;t<sz;t++){
-
-        out<<"t= "<<t<<"  ";
-        // Scale Hamiltonian (off-diagonal elements)
-        for(int i=0;i<nst;i++){
-          for(int j=0;j<nst;j++){
-            if(i!=j){
-              double dEij = (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real());
-              double tau = 1000.0; // 1 ps
-              if(rates.M[i*nst+j].real()>0.0){
-                tau = (1.0/rates.M[i*nst+j].real());
-              }
-              // Matyushov's formula
-              //double kb =   8.617e-5;      // units = eV/K
-              double cm_inv = 1.23981e-4;  // 1 cm^-1 in eV
-              double T = 300.0;
-              double kT = kb*T;
-              double omega_v = 2000.0 * cm_inv;  // eV
-
-              
-              double lambda_v = hbar*hbar/(kT*tau*tau);
-              double lambda_s = lambda_v; 
-
-              double  S = lambda_v / (hbar*omega_v);
-              //    print "Huang-Rhys factor = ", S
-
-              double xi_v = hbar*omega_v/(2.0*kT);
-              //    print "xi_v = ", xi_v
-
-              double prefac = 1.0/sqrt(4.0*M_PI*lambda_s*kT);
-
-              double res = 0.0;
-
-              for(int m=0;m<10;m++){
-
-                double I = 1.0;
-                for(int i=1;i<=m;i++){
-                  I = I * (S/float(i));
-                }             
-                double A_m = exp(-S) * I;
-
-                double x = (fabs(dEij) + m*hbar*omega_v);
-                res += A_m * exp(-( x*x/(4.0*lambda_s*kT) ) );
+          }// decoherence == 3
+
+          else if(is.decoherence==4){
+            // Matyushov's formula: F^2 = prefac * sum_m { A_m * exp(-(|dE| + m*hbar*omega_v)^2/(4*lambda_s*kT)) }
+            // With a = |dE|, b = hbar*omega_v, c = 1/(4*lambda_s*kT) the terms are factored as
+            // exp(-c*a^2) * exp(-2*c*a*b)^m * exp(-c*m^2*b^2), so only 2 exponents are evaluated per time step
+            double cm_inv = 1.23981e-4;  // 1 cm^-1 in eV
+            double T = 300.0;
+            double kT = kb*T;
+            double omega_v = 2000.0 * cm_inv;  // eV
+
+            double lambda_v = hbar*hbar/(kT*tau*tau);
+            double lambda_s = lambda_v; 
+
+            double  S = lambda_v / (hbar*omega_v);  // Huang-Rhys factor
+            double prefac = 1.0/sqrt(4.0*M_PI*lambda_s*kT);
+            double c = 1.0/(4.0*lambda_s*kT);
+            double b = hbar*omega_v;
+
+            double B[10];  // A_m * exp(-c*m^2*b^2)
+            for(int m=0;m<10;m++){
+              double I = 1.0;
+              for(int k=1;k<=m;k++){
+                I = I * (S/float(k));
               }
-              res *= prefac;
-
-
-//              double x = fabs(0.5*(dEij * tau / hbar));
-//              double F = sqrt( sqrt(1.0/M_PI) * x * exp(-x*x) );
-              double F = sqrt(res);
-
-//              if(x>maxx){  F = (maxf + (maxf - F))/(2.0*maxf); }
-
-
-              me_es[t].Hcurr->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hprev->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hnext->M[i*nst+j] *= F;  // scale NAC
-
-              out<<" dE("<<i<<","<<j<<")= "<<dEij<<" F= "<<F<<" ";
-            }// i!=j
-          }// for j
-        }// for i
-        out<<endl;
-      }// for t
-      out.close();
+              double A_m = exp(-S) * I;
+              B[m] = A_m * exp(-c*m*m*b*b);
+            }
 
+            for(t=0;t<sz;t++){
+              double a = fabs(g[t]);
+              double r = exp(-2.0*c*a*b);
+              double res = B[9];
+              for(int m=8;m>=0;m--){ res = res*r + B[m]; }
+              res *= prefac * exp(-c*a*a);
 
-/*
-      std::string filename = is.scratch_dir+"/scaling_factors_icond"+int2string(icond)+".txt";
-      ofstream out(filename.c_str(),ios::out);
+              f[t] = sqrt(res);
+            }// for t
+          }// decoherence == 4
 
-      double maxx = sqrt(0.5);
-      double maxf = exp(-0.25)/pow(2.0*M_PI, 0.25);
+          for(t=0;t<sz;t++){
+            me_es[t].Hcurr->u[ij] *= f[t];  // scale NAC
+          }
 
-      for(int t=0;t<sz;t++){
+          if(is.scaling_output){
+            for(t=0;t<sz;t++){
+              Fout[ij*sz+t] = f[t];
+              dEout[ij*sz+t] = (is.decoherence==2)? d2E_av : g[t];
+            }
+          }
 
-        out<<"t= "<<t<<"  ";
-        // Scale Hamiltonian (off-diagonal elements)
-        for(int i=0;i<nst;i++){
-          for(int j=0;j<nst;j++){
-            if(i!=j){
-              double dEij = (me_es[t].Hcurr->M[i*nst+i].real() - me_es[t].Hcurr->M[j*nst+j].real());
-              double tau = 1000.0; // 1 ps
-              if(rates.M[i*nst+j].real()>0.0){
-                tau = (1.0/rates.M[i*nst+j].real());
-              }
-              
-              double x = fabs(0.5*(dEij * tau / hbar));  
-              double F = sqrt( sqrt(1.0/M_PI) * x * exp(-x*x) );
+        }// for j
+      }// for i
 
-              if(x>maxx){  F = (maxf + (maxf - F))/(2.0*maxf); }
-           
 
-              me_es[t].Hcurr->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hprev->M[i*nst+j] *= F;  // scale NAC
-              me_es[t].Hnext->M[i*nst+j] *= F;  // scale NAC
+      if(is.scaling_output){
+        // One line per time step with all pairs, F_ji = F_ij and dE_ji = -dE_ij (average fluctuation for decoherence = 2)
+        std::string filename = is.scratch_dir+"/scaling_factors_icond"+int2string(icond)+".txt";
+        ofstream out(filename.c_str(),ios::out);
+        for(t=0;t<sz;t++){
+          out<<"t= "<<t<<"  ";
+          for(i=0;i<nst;i++){
+            for(j=0;j<nst;j++){
+              if(i!=j){
+                int ij = (i<j)? me_es[0].Hcurr->upper(i,j) : me_es[0].Hcurr->upper(j,i);
+                double dEij = dEout[ij*sz+t];
+                if(i>j && is.decoherence!=2){ dEij = -dEij; }
+                out<<" dE("<<i<<","<<j<<")= "<<dEij<<" F= "<<Fout[ij*sz+t]<<" ";
+              }// i!=j
+            }// for j
+          }// for i
+          out<<"\n";
+        }// for t
+        out.close();
+      }
 
-              out<<" dE("<<i<<","<<j<<")= "<<dEij<<" F= "<<F<<" ";
-            }// i!=j
-          }// for j
-        }// for i
-        out<<endl;
-      }// for t
-      out.close();
-*/
-    }//is.decoherence == 4
+    }// decoherence == 2, 3, 4
 
     if(is.decoherence==5){ // Coherence Penalty Functional
      // add nothing special here
@@ -938,11 +1202,23 @@ void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_
   //==================== Propagate many-electron orbitals =====================================
   // The outer loop (which calls run_namd1 function) averages over initial conditions
 
+  // Boltzmann factors depend only on the nuclear step, so they are computed once 
+  // for the whole timeline and then reused by all trajectories. With the field or with
+  // integrators that modify Hcurr they are computed on the fly
+  if(is.is_field==0 && is.integrator!=10 && is.integrator!=11){
+    for(i=0;i<sz;i++){ me_es[i].precompute_boltz_factors(is.Temp); }
+  }
+
   // Do the hops - averaging over trajectories (stochastic realizations)
-  for(n=0;n<is.num_sh_traj;n++){
+  // With sh_batch > 0 the trajectories are propagated in batches by run_sh_batch instead
+  if(is.sh_batch>0){  run_sh_batch(is,me_es,rates,sh_pops,se_pops); }
+  int num_serial = (is.sh_batch>0)? 0 : is.num_sh_traj;
+
+  for(n=0;n<num_serial;n++){
 
     me_es[0].set_state(init_state);
-    me_es[0].t_m[0] = 0.0; // Time since last hop
+    for(j=0;j<nst;j++){ me_es[0].t_m[j] = 0.0; } // Times since last hop/decoherence event, all states
+    me_es[0].reset_decoherence_events();
 
     // Loop over time
     for(i=0;i<sz;i++){
@@ -958,45 +1234,7 @@ void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_
                                                             
 
       // Calculate the probabilities off all states and hopping probabilities
-      me_es[i].update_populations();
-
-      if(is.decoherence==0){  // FSSH
-//        curr_state = me_es[i].curr_state;
-        hop(me_es[i].g,me_es[i].curr_state,nst);
-        curr_state = me_es[i].curr_state;
-      }
-      else if(is.decoherence==1){  // DISH - currently any value >0
-        me_es[i].check_decoherence(is.nucl_dt,is.boltz_flag,is.Temp,rates);
-        curr_state = me_es[i].curr_state;
-      }// decoherence == 1
-
-      else if(is.decoherence==2 || is.decoherence==3 || is.decoherence==4){  // NAC scaling
-//        curr_state = me_es[i].curr_state;
-        hop(me_es[i].g,me_es[i].curr_state,nst);
-        curr_state = me_es[i].curr_state;
-
-      }// decoherence == 2
-      else if(is.decoherence==5){  // CPF
-       // Nothing to do here, because it is MF theory
-      }
-      else if(is.decoherence==6){  // 
-        int st_before = me_es[i].curr_state;
-
-        hop(me_es[i].g,me_es[i].curr_state,nst);
-
-        curr_state = me_es[i].curr_state;
-        // Collapse WFC
-
-        if(st_before!=curr_state){ // Hop has happened - collapse wfc
-
-          me_es[i].t_m[0] = 0.0;
-
-          double argg = M_PI*uniform(-1.0,1.0);
-          *me_es[i].Ccurr  = 0.0;
-           me_es[i].Ccurr->M[curr_state] = complex<double>( cos(argg), sin(argg) );          
-        }
-
-      }// is.decoherence==6
+      if(surface_hop(is,me_es[i],rates)){  curr_state = me_es[i].curr_state; }
 
 /*  Debug
         cout<<"hop_matrix:\n";
@@ -1013,7 +1251,7 @@ void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_
 
       // Accumulate SE and SH probabilities for all states
       sh_pops[i][curr_state] += 1.0;
-      for(j=0;j<nst;j++){ se_pops[i][j] += me_es[i].A->M[j*nst+j].real(); }
+      for(j=0;j<nst;j++){ se_pops[i][j] += me_es[i].population(j); }
 
     }// namdtime
   }// for num_sh_traj
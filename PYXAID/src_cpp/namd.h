@@ -15,12 +15,34 @@
 #include "ElectronicStructure.h"
 
 
+// Decoherence rates and spectral densities of one initial condition, handed
+// from run_decoherence_rates to run_namd1 without going through the disk
+struct decoherence_data{
+  int nst;                          // number of electronic states
+  double dE;                        // spacing of the energy grid of the spectral densities
+  vector< vector<double> > rates;   // nst x nst matrix of decoherence rates
+  vector< vector<double> > J;       // spectral density of pair (i,j), i<j, is stored in J[i*nst+j]
+
+  vector<double>& spectral_density(int i,int j){ return (i<j)? J[i*nst+j] : J[j*nst+i]; }
+};
+
+
 void hop(vector<double>& sh_prob,int& state,int num_states);
 void solve_electronic(InputStructure& is,vector<ElectronicStructure>& es,matrix&);
 
-void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond);
+void spectral_density_binary(std::string filename,decoherence_data& dd);
+int read_spectral_density_binary(std::string filename,decoherence_data& dd);
+void decoherence_cache_write(std::string filename,std::string key,decoherence_data& dd);
+int decoherence_cache_read(std::string filename,std::string key,decoherence_data& dd);
+void compute_decoherence_data(InputStructure& is,vector< vector<double> >& E,decoherence_data& dd);
+void decoherence_data_output(InputStructure& is,int icond,decoherence_data& dd);
+void run_decoherence_rates(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd);
 void run_namd(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states,int icond);
-void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond);
+int surface_hop(InputStructure& is,ElectronicStructure& es,matrix& rates);
+void run_sh_batch(InputStructure& is, vector<ElectronicStructure>& me_es,matrix& rates,
+                  vector<vector<double> >& sh_pops,vector<vector<double> >& se_pops);
+void run_namd1(InputStructure& is, vector<ElectronicStructure>& me_es,vector<me_state>& me_states, int icond,decoherence_data& dd);
+void report_elec_steps(std::string filename,int icond,vector<ElectronicStructure>& es);
 
 
 #endif // NAMD_H
@@ -14,6 +14,7 @@
 #include <sstream>
 #include <time.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <time.h>
 #include "ElectronicStructure.h"
 #include "aux.h"
@@ -26,6 +27,81 @@ using namespace boost::python;
 using namespace std;
 
 
+void check_hermitian(const matrix& m,std::string filename){
+// The matrices read from the files are stored as hermitian_matrix, which keeps only the diagonal
+// and the upper triangle, so a non-Hermitian input would silently change the Hamiltonian
+  double tol = 1e-8;
+  double err = hermiticity_error(m);
+  if(err>tol){
+    cout<<"Warning: the matrix read from "<<filename<<" is not Hermitian: ||A - A^+||/||A|| = "<<err
+        <<". Only its diagonal and upper triangle are used\n";
+  }
+}
+
+std::string decoherence_cache_key(InputStructure& params,vector<me_state>& me_states,int w_start,int w_len,
+                                  vector< vector<double> >& E){
+// Everything the decoherence rates of the window depend on. A cache file is only used if its key is the same
+  std::stringstream key;
+  key<<setprecision(17);
+  key<<"nucl_dt= "<<params.nucl_dt<<" regress_mode= "<<params.regress_mode<<" window= "<<w_start<<" "<<w_len<<"\n";
+  key<<"Ham_re= "<<params.Ham_re_prefix<<"*"<<params.Ham_re_suffix<<" Ham_im= "<<params.Ham_im_prefix<<"*"<<params.Ham_im_suffix
+     <<" read_couplings= "<<params.read_couplings<<" energy_units= "<<params.energy_units<<"\n";
+  for(int I=0;I<(int)me_states.size();I++){
+    key<<"state "<<me_states[I].name<<" Eshift= "<<me_states[I].Eshift<<" active_space=";
+    for(int k=0;k<(int)me_states[I].active_space.size();k++){ key<<" "<<me_states[I].active_space[k]; }
+    key<<" actual_state=";
+    for(int k=0;k<(int)me_states[I].actual_state.size();k++){ key<<" "<<me_states[I].actual_state[k]; }
+    key<<"\n";
+  }
+
+  // Checksum (FNV-1a) of the energies of the window, bit by bit
+  unsigned long long h = 14695981039346656037ULL;
+  for(int t=0;t<(int)E.size();t++){
+    const unsigned char* b = (const unsigned char*)&E[t][0];
+    for(int k=0;k<(int)(E[t].size()*sizeof(double));k++){ h ^= b[k];  h *= 1099511628211ULL; }
+  }
+  key<<"energies= "<<E.size()<<" x "<<((E.size()>0)? E[0].size() : 0)<<" checksum= "<<hex<<h<<"\n";
+
+  return key.str();
+}
+
+void me_energies(InputStructure& params,vector<me_state>& me_states,vector<hermitian_matrix>& H_batch,double en_scl,
+                 int start,int len,vector< vector<double> >& E){
+// Energies of the multi-electron states for the nuclear steps start, ... , start+len-1
+// These are the diagonal elements of me_es[t].Hcurr as composed in the icond loop, but computed
+// without setting up the ElectronicStructure objects, so the window may be as long as the whole trajectory
+  int nst = me_states.size();
+  int numstates = me_states[0].active_space.size();
+  int num_elec = me_states[0].actual_state.size();
+  vector<double> e_orb(2*numstates,0.0); // energies of alpha and beta 1-electron orbitals
+
+  E = vector< vector<double> >(len,vector<double>(nst,0.0));
+
+  for(int j=start;j<start+len;j++){
+    int t = (j - start);
+
+    if(params.read_couplings=="batch" || params.read_couplings=="batch_all_in_one"){
+      for(int k=0;k<numstates;k++){ e_orb[2*k] = e_orb[2*k+1] = H_batch[j].d[k]; }
+    }
+    else{
+      vector< vector<double> > Ham_re, Ham_re_crop;
+      std::string Ham_re_file; Ham_re_file = params.Ham_re_prefix + int2string(j) + params.Ham_re_suffix;
+      file2matrix(Ham_re_file,Ham_re);
+      extract_2D(Ham_re,Ham_re_crop,me_states[0].active_space,-1);
+      for(int k=0;k<numstates;k++){ e_orb[2*k] = e_orb[2*k+1] = Ham_re_crop[k][k]*en_scl; }
+    }
+
+    for(int I=0;I<nst;I++){
+      E[t][I] = me_states[I].Exc + me_states[I].Eshift;
+      for(int el=0;el<num_elec;el++){
+        E[t][I] += e_orb[ext2int(me_states[I].actual_state[el],me_states[I].active_space)];
+      }
+    }// for I
+  }// for j
+
+}
+
+
 int namd(boost::python::dict inp_params){
 
   time_t t1 = clock();
@@ -78,14 +154,19 @@ int namd(boost::python::dict inp_params){
   for(int icond=0;icond<iconds.size();icond++){
     if(iconds[icond][0]>=max_indx){ max_indx = iconds[icond][0]; }
   }// for icond
+  int min_indx = max_indx;
+  for(int icond=0;icond<(int)iconds.size();icond++){
+    if(iconds[icond][0]<=min_indx){ min_indx = iconds[icond][0]; }
+  }// for icond
   max_indx += params.namdtime;
   cout<<"Maximal Hamiltonian file to read is "<<params.Ham_re_prefix<<(max_indx+1)<<params.Ham_re_suffix<<endl;
 
   // Read all necessary couplings and transition dipole (if necessary) files - batch mode
-  vector< matrix > H_batch;
-  vector< matrix > Hprime_x_batch;
-  vector< matrix > Hprime_y_batch;
-  vector< matrix > Hprime_z_batch;
+  // The matrices are Hermitian, so they are kept in packed form
+  vector< hermitian_matrix > H_batch;
+  vector< hermitian_matrix > Hprime_x_batch;
+  vector< hermitian_matrix > Hprime_y_batch;
+  vector< hermitian_matrix > Hprime_z_batch;
 
   if(params.read_couplings=="batch" || params.read_couplings=="batch_all_in_one"){
 
@@ -138,7 +219,8 @@ int namd(boost::python::dict inp_params){
       Ham *= en_scl;
       if(params.debug_flag==2){   cout<<"Scaled Ham = "<<Ham<<endl; }
 
-      H_batch.push_back(Ham);
+      check_hermitian(Ham,Ham_re_file+" + i*"+Ham_im_file);
+      H_batch.push_back(hermitian_matrix(Ham));
 
 
       // -------------------- Real part of the transition dipole matrix -------------------------------------
@@ -182,9 +264,12 @@ int namd(boost::python::dict inp_params){
           cout<<"Scaled Hprimez = "<<Hprimez<<endl;
         }
 
-        Hprime_x_batch.push_back(Hprimex);
-        Hprime_y_batch.push_back(Hprimey);
-        Hprime_z_batch.push_back(Hprimez);
+        check_hermitian(Hprimex,Hprime_x_file);
+        check_hermitian(Hprimey,Hprime_y_file);
+        check_hermitian(Hprimez,Hprime_z_file);
+        Hprime_x_batch.push_back(hermitian_matrix(Hprimex));
+        Hprime_y_batch.push_back(hermitian_matrix(Hprimey));
+        Hprime_z_batch.push_back(hermitian_matrix(Hprimez));
 
 
       }// if one wants explicit field effects
@@ -203,9 +288,14 @@ int namd(boost::python::dict inp_params){
   timer.Start("icond loop");
 
   cout<<"Starting the program...\n";
+
+  // Decoherence rates are kept between initial conditions, so they can be reused if the window is the same
+  decoherence_data dd;
+  int dd_start = -1;  // window of the trajectory the rates in dd have been computed from
+  int dd_len = 0;
   //for(icond=0;icond<iconds.size();icond++){  // first_icond may start from 0, not 1
      // Use myproc and nprocs to loop through my iconds only
-  for( icond=params.myproc; icond<iconds.size(); icond += params.nprocs){
+  for(int icond=params.myproc; icond<iconds.size(); icond += params.nprocs){
      //srand(icond);   // For debugging only
 
     if(params.debug_flag==2){
@@ -223,8 +313,8 @@ int namd(boost::python::dict inp_params){
       if(params.debug_flag==1){    cout<<"----------- j = "<<j<<" -------------------"<<endl;}
       int t = (j - iconds[icond][0]);  // Time
 
-      matrix* T;
-      matrix *Tx, *Ty, *Tz;
+      hermitian_matrix* T;
+      hermitian_matrix *Tx, *Ty, *Tz;
 
       if(params.read_couplings=="online" || params.read_couplings=="online_all_in_one"){
 
@@ -268,8 +358,8 @@ int namd(boost::python::dict inp_params){
         Ham *= en_scl;
         if(params.debug_flag==2){   cout<<"Scaled Ham = "<<Ham<<endl; }
 
-        T = new matrix(Ham.n_rows,Ham.n_cols);
-        *T = Ham;
+        check_hermitian(Ham,Ham_re_file+" + i*"+Ham_im_file);
+        T = new hermitian_matrix(Ham);
 
 
         // -------------------- Real part of the transition dipole matrix -------------------------------------
@@ -296,9 +386,10 @@ int namd(boost::python::dict inp_params){
 
           vector< vector<double> > tmp(Hprime_x_crop.size(),vector<double>(Hprime_x_crop.size(),0.0));
           //------------ Create matrix --------
-          matrix Hprimex(Hprime_x_crop,tmp);
-          matrix Hprimey(Hprime_y_crop,tmp);
-          matrix Hprimez(Hprime_z_crop,tmp);
+          // Hprime_ is purely imaginary, as in the batch mode
+          matrix Hprimex(tmp,Hprime_x_crop);
+          matrix Hprimey(tmp,Hprime_y_crop);
+          matrix Hprimez(tmp,Hprime_z_crop);
 
           Hprimex *= hp_scl; Hprimey *= hp_scl; Hprimez *= hp_scl;
           if(params.debug_flag==2){
@@ -307,27 +398,30 @@ int namd(boost::python::dict inp_params){
             cout<<"Scaled Hprimez = "<<Hprimez<<endl;
           }
 
-          Tx = new matrix(Hprimex.n_rows,Hprimex.n_cols);  *Tx = Hprimex;
-          Ty = new matrix(Hprimey.n_rows,Hprimey.n_cols);  *Ty = Hprimey;
-          Tz = new matrix(Hprimez.n_rows,Hprimez.n_cols);  *Tz = Hprimez;
+          check_hermitian(Hprimex,Hprime_x_file);
+          check_hermitian(Hprimey,Hprime_y_file);
+          check_hermitian(Hprimez,Hprime_z_file);
+          Tx = new hermitian_matrix(Hprimex);
+          Ty = new hermitian_matrix(Hprimey);
+          Tz = new hermitian_matrix(Hprimez);
 
         }// if params.is_field==1
 
       }// "online"
       else if(params.read_couplings=="batch"){ 
-        T = new matrix(H_batch[j].n_rows,H_batch[j].n_cols);   *T = H_batch[j];
+        T = new hermitian_matrix(H_batch[j]);
 
         if(params.is_field==1){
-          Tx = new matrix(Hprime_x_batch[j].n_rows,Hprime_x_batch[j].n_cols); *Tx = Hprime_x_batch[j];
-          Ty = new matrix(Hprime_y_batch[j].n_rows,Hprime_y_batch[j].n_cols); *Ty = Hprime_y_batch[j];
-          Tz = new matrix(Hprime_z_batch[j].n_rows,Hprime_z_batch[j].n_cols); *Tz = Hprime_z_batch[j];
+          Tx = new hermitian_matrix(Hprime_x_batch[j]);
+          Ty = new hermitian_matrix(Hprime_y_batch[j]);
+          Tz = new hermitian_matrix(Hprime_z_batch[j]);
         }// if params.is_field==1
       }// "batch"
 
-      matrix Hij(T->n_rows,T->n_cols);    Hij = *T; 
-      matrix Hij_prime_x(T->n_rows,T->n_cols); Hij_prime_x = 0.0; 
-      matrix Hij_prime_y(T->n_rows,T->n_cols); Hij_prime_y = 0.0;
-      matrix Hij_prime_z(T->n_rows,T->n_cols); Hij_prime_z = 0.0;
+      hermitian_matrix Hij(*T);
+      hermitian_matrix Hij_prime_x(T->n);
+      hermitian_matrix Hij_prime_y(T->n);
+      hermitian_matrix Hij_prime_z(T->n);
       delete T;
 
       if(params.is_field==1){   Hij_prime_x = *Tx; Hij_prime_y = *Ty; Hij_prime_z = *Tz;  delete Tx; delete Ty; delete Tz; }
@@ -350,7 +444,7 @@ int namd(boost::python::dict inp_params){
         *oe_es[t].Hprimez = 0.0;
 
         for(int k1=0;k1<numstates;k1++){
-          for(int k2=0;k2<numstates;k2++){
+          for(int k2=k1;k2<numstates;k2++){
             /**************************************
               Setting block matrix:
   
@@ -360,53 +454,38 @@ int namd(boost::python::dict inp_params){
                    |
             j_bet  |.d[2*k1+1][2*k2]  .d[2*k1+1][2*k2+1]
 
+              Only k2>=k1 blocks are set: the rest is
+              the Hermitian conjugate, which is not stored
              **************************************/
+           complex<double> h   = Hij.get(k1,k2);
+           complex<double> h_x = Hij_prime_x.get(k1,k2);
+           complex<double> h_y = Hij_prime_y.get(k1,k2);
+           complex<double> h_z = Hij_prime_z.get(k1,k2);
+
            //Couplings: dij = <i|d/dt|j> 
-           oe_es[t].Hcurr->M[2*k1*(2*numstates)+2*k2] = Hij.M[k1*numstates+k2];
-           oe_es[t].Hcurr->M[(2*k1+1)*(2*numstates)+2*k2+1] = Hij.M[k1*numstates+k2];
+           oe_es[t].Hcurr->set(2*k1,2*k2,h);
+           oe_es[t].Hcurr->set(2*k1+1,2*k2+1,h);
 
            //Perturbations
-           oe_es[t].Hprimex->M[2*k1*(2*numstates)+2*k2] = Hij_prime_x.M[k1*numstates+k2];
-           oe_es[t].Hprimex->M[(2*k1+1)*(2*numstates)+2*k2+1] = Hij_prime_x.M[k1*numstates+k2];
-
-           oe_es[t].Hprimey->M[2*k1*(2*numstates)+2*k2] = Hij_prime_y.M[k1*numstates+k2];
-           oe_es[t].Hprimey->M[(2*k1+1)*(2*numstates)+2*k2+1] = Hij_prime_y.M[k1*numstates+k2];
-
-           oe_es[t].Hprimez->M[2*k1*(2*numstates)+2*k2] = Hij_prime_z.M[k1*numstates+k2];
-           oe_es[t].Hprimez->M[(2*k1+1)*(2*numstates)+2*k2+1] = Hij_prime_z.M[k1*numstates+k2];
+           oe_es[t].Hprimex->set(2*k1,2*k2,h_x);
+           oe_es[t].Hprimex->set(2*k1+1,2*k2+1,h_x);
 
+           oe_es[t].Hprimey->set(2*k1,2*k2,h_y);
+           oe_es[t].Hprimey->set(2*k1+1,2*k2+1,h_y);
 
-            if(params.alp_bet==0){ // Electrons with a spin, no coupling between alp and bet, default
-
-              oe_es[t].Hcurr->M[(2*k1+1)*(2*numstates)+2*k2] = 
-              oe_es[t].Hcurr->M[2*k1*(2*numstates)+2*k2+1] = 0.0;
-
-              oe_es[t].Hprimex->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimex->M[2*k1*(2*numstates)+2*k2+1] = 0.0;
-
-              oe_es[t].Hprimey->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimey->M[2*k1*(2*numstates)+2*k2+1] = 0.0;
-
-              oe_es[t].Hprimez->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimez->M[2*k1*(2*numstates)+2*k2+1] = 0.0;
+           oe_es[t].Hprimez->set(2*k1,2*k2,h_z);
+           oe_es[t].Hprimez->set(2*k1+1,2*k2+1,h_z);
 
 
+            // alp_bet==0: Electrons with a spin, no coupling between alp and bet (zero blocks), default
+            if(params.alp_bet==1){ // Spinless electrons, coupling between alp and bet is !=0, based only
+                                   // on spatial part of the wavefunctions
+              oe_es[t].Hcurr->set(2*k1+1,2*k2,h);      oe_es[t].Hcurr->set(2*k1,2*k2+1,h);
+              oe_es[t].Hprimex->set(2*k1+1,2*k2,h_x);  oe_es[t].Hprimex->set(2*k1,2*k2+1,h_x);
+              oe_es[t].Hprimey->set(2*k1+1,2*k2,h_y);  oe_es[t].Hprimey->set(2*k1,2*k2+1,h_y);
+              oe_es[t].Hprimez->set(2*k1+1,2*k2,h_z);  oe_es[t].Hprimez->set(2*k1,2*k2+1,h_z);
             }
-            else if(params.alp_bet==1){ // Spinless electrons, coupling between alp and bet is !=0, based only
-                                        // on spatial part of the wavefunctions
-              oe_es[t].Hcurr->M[(2*k1+1)*(2*numstates)+2*k2] = 
-              oe_es[t].Hcurr->M[2*k1*(2*numstates)+2*k2+1] = Hij.M[k1*numstates+k2];
-
-              oe_es[t].Hprimex->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimex->M[2*k1*(2*numstates)+2*k2+1] = Hij_prime_x.M[k1*numstates+k2];
-
-              oe_es[t].Hprimey->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimey->M[2*k1*(2*numstates)+2*k2+1] = Hij_prime_y.M[k1*numstates+k2];
 
-              oe_es[t].Hprimez->M[(2*k1+1)*(2*numstates)+2*k2] =
-              oe_es[t].Hprimez->M[2*k1*(2*numstates)+2*k2+1] = Hij_prime_z.M[k1*numstates+k2];
-
-            }
           }// for k2
         }// for k1
 //      }// if namd
@@ -425,7 +504,7 @@ int namd(boost::python::dict inp_params){
     //======================== Compute multi-electron Hamiltonians ==========================
     //-------------------- Couplings -----------------------------------------
     // Now we consider all multi-electron states
-    for(j=iconds[icond][0];j<iconds[icond][0]+params.namdtime;j++){
+    for(int j=iconds[icond][0];j<iconds[icond][0]+params.namdtime;j++){
       int t = (j - iconds[icond][0]);  // Time
       int I,J;
 
@@ -434,21 +513,10 @@ int namd(boost::python::dict inp_params){
       *me_es[t].Hprimey = 0.0;
       *me_es[t].Hprimez = 0.0;
 
-      // Initialize Energies, NACs and Hprime
+      // Initialize Energies, NACs and Hprime (the latter two are already zero)
       for(I=0;I<me_es[t].num_states;I++){
         // This initialization already includes shift of 1-e orbitals and 2-particle corrections
-        me_es[t].Hcurr->M[I*me_es[t].num_states+I] = me_states[I].Exc + me_states[I].Eshift;
-
-        for(J=0;J<me_es[t].num_states;J++){
-          // off-diagonal elements - NAC
-          if(I!=J){ me_es[t].Hcurr->M[I*me_es[t].num_states+J] = 0.0;    }
-
-          // Perturbations
-          me_es[t].Hprimex->M[I*me_es[t].num_states+J] = 0.0;
-          me_es[t].Hprimey->M[I*me_es[t].num_states+J] = 0.0;
-          me_es[t].Hprimez->M[I*me_es[t].num_states+J] = 0.0;
-
-        }// for J
+        me_es[t].Hcurr->d[I] = me_states[I].Exc + me_states[I].Eshift;
       }// for I
 
 
@@ -456,7 +524,8 @@ int namd(boost::python::dict inp_params){
       // Compute many-electron properties from those of the 1-electron
       for(I=0;I<me_es[t].num_states;I++){          // Numerate the me state on which we project.
                                                    // This multi-electron state J is defined by me_states[J]
-        for(J=0;J<me_es[t].num_states;J++){
+        // Only J>I: the matrices are Hermitian and only their upper triangles are stored
+        for(J=I+1;J<me_es[t].num_states;J++){
 
           // Practically there will be only one non-zero contribution, corresponding to
           // the pair of different indexes, for which all other indexes are identical
@@ -474,13 +543,14 @@ int namd(boost::python::dict inp_params){
 
             // In the statements below the += operator should be encountered only once over I, J double loop
             // so initialization inside second loop is ok. Also += is effectively = operator.
+            int IJ = me_es[t].Hcurr->upper(I,J);
             // NAC and energy
-            me_es[t].Hcurr->M[I*me_es[t].num_states+J] += oe_es[t].Hcurr->M[orb_i*oe_es[t].num_states+orb_j];
+            me_es[t].Hcurr->u[IJ] += oe_es[t].Hcurr->get(orb_i,orb_j);
 
             // Perturbations - transition dipole moments
-            me_es[t].Hprimex->M[I*me_es[t].num_states+J] += oe_es[t].Hprimex->M[orb_i*oe_es[t].num_states+orb_j];
-            me_es[t].Hprimey->M[I*me_es[t].num_states+J] += oe_es[t].Hprimey->M[orb_i*oe_es[t].num_states+orb_j];
-            me_es[t].Hprimez->M[I*me_es[t].num_states+J] += oe_es[t].Hprimez->M[orb_i*oe_es[t].num_states+orb_j];
+            me_es[t].Hprimex->u[IJ] += oe_es[t].Hprimex->get(orb_i,orb_j);
+            me_es[t].Hprimey->u[IJ] += oe_es[t].Hprimey->get(orb_i,orb_j);
+            me_es[t].Hprimez->u[IJ] += oe_es[t].Hprimez->get(orb_i,orb_j);
 
 
           }// if delt
@@ -489,21 +559,21 @@ int namd(boost::python::dict inp_params){
             // Only for the first time step output info - to check what is the NAC structure of the system
             cout<<"I, J, delt, coupling(not scaled), orb_i, orb_j, Hprimex, Hprimey, Hprimez = "
                 <<I<<"  "<<J<<"  "<<delt<<"  "
-                <<me_es[t].Hcurr->M[I*me_es[t].num_states+J]<<"  "<<orb_i<<"  "<<orb_j<<"  "
-                <<me_es[t].Hprimex->M[I*me_es[t].num_states+J]<<"  "
-                <<me_es[t].Hprimey->M[I*me_es[t].num_states+J]<<"  "
-                <<me_es[t].Hprimez->M[I*me_es[t].num_states+J]<<"  "
+                <<me_es[t].Hcurr->get(I,J)<<"  "<<orb_i<<"  "<<orb_j<<"  "
+                <<me_es[t].Hprimex->get(I,J)<<"  "
+                <<me_es[t].Hprimey->get(I,J)<<"  "
+                <<me_es[t].Hprimez->get(I,J)<<"  "
 
                 <<endl;
           }
 */
       }// for J
 
-      // Now scale the coupling!!!
+      // Now scale the coupling!!! The pair (I,J) is listed for both states, but is stored only once
       int sz_scl = me_states[I].nac_scl.size();
       for(int k=0;k<sz_scl;k++){
         J = me_states[I].nac_scl_indx[k];
-        me_es[t].Hcurr->M[I*me_es[t].num_states+J] *= me_states[I].nac_scl[k];
+        if(J>I){ me_es[t].Hcurr->u[me_es[t].Hcurr->upper(I,J)] *= me_states[I].nac_scl[k]; }
       }// for k
 
       // Compute the energy and the perturbation of the macrostate
@@ -511,17 +581,17 @@ int namd(boost::python::dict inp_params){
         int orb_i = me_states[I].actual_state[el];        // orbital on which el-th electron sits in current function
         orb_i = ext2int(orb_i,me_states[I].active_space); // internal index of the orbital
         // Energy of I-th basis function (determinant) - contributions of all 1-electron KS orbitals - diagonal terms
-        me_es[t].Hcurr->M[I*me_es[t].num_states+I] += oe_es[t].Hcurr->M[orb_i*oe_es[t].num_states+orb_i]; 
+        me_es[t].Hcurr->d[I] += oe_es[t].Hcurr->d[orb_i]; 
 
         if(params.debug_flag>=1 && t==0){
         cout<<"I= "<<I<<" el= "<<el<<" orb_i= "<<orb_i<<" E_{KS,orb_i}= "
-            <<oe_es[t].Hcurr->M[orb_i*oe_es[t].num_states+orb_i]<<" E_{state,I}= "
-            << me_es[t].Hcurr->M[I*me_es[t].num_states+I]<<endl;
+            <<oe_es[t].Hcurr->get(orb_i,orb_i)<<" E_{state,I}= "
+            << me_es[t].Hcurr->get(I,I)<<endl;
         }
 
-        me_es[t].Hprimex->M[I*me_es[t].num_states+I] += oe_es[t].Hprimex->M[orb_i*oe_es[t].num_states+orb_i];
-        me_es[t].Hprimey->M[I*me_es[t].num_states+I] += oe_es[t].Hprimey->M[orb_i*oe_es[t].num_states+orb_i];
-        me_es[t].Hprimez->M[I*me_es[t].num_states+I] += oe_es[t].Hprimez->M[orb_i*oe_es[t].num_states+orb_i];
+        me_es[t].Hprimex->d[I] += oe_es[t].Hprimex->d[orb_i];
+        me_es[t].Hprimey->d[I] += oe_es[t].Hprimey->d[orb_i];
+        me_es[t].Hprimez->d[I] += oe_es[t].Hprimez->d[orb_i];
 
 
       }// for el
@@ -536,10 +606,10 @@ int namd(boost::python::dict inp_params){
             // Only for the first time step output info - to check what is the NAC structure of the system
             cout<<"I, J, coupling(scaled), Hprimex, Hprimey, Hprimez = "
                 <<I<<"  "<<J<<"  "
-                <<me_es[t].Hcurr->M[I*me_es[t].num_states+J]<<"  "
-                <<me_es[t].Hprimex->M[I*me_es[t].num_states+J]<<"  "
-                <<me_es[t].Hprimey->M[I*me_es[t].num_states+J]<<"  "
-                <<me_es[t].Hprimez->M[I*me_es[t].num_states+J]<<"  "
+                <<me_es[t].Hcurr->get(I,J)<<"  "
+                <<me_es[t].Hprimex->get(I,J)<<"  "
+                <<me_es[t].Hprimey->get(I,J)<<"  "
+                <<me_es[t].Hprimez->get(I,J)<<"  "
                 <<endl;
           }
 
@@ -558,11 +628,11 @@ int namd(boost::python::dict inp_params){
     string outfile = (params.scratch_dir + "/me_energies"+int2string(icond));
     cout<<"The energies of basis  states (with respect to defined ground state) for the this initial condition are written in file "<<outfile<<"\n";
     ofstream out; out.open(outfile.c_str(),ios::out);
-    for(j=iconds[icond][0];j<iconds[icond][0]+params.namdtime;j++){
+    for(int j=iconds[icond][0];j<iconds[icond][0]+params.namdtime;j++){
       int t = (j - iconds[icond][0]);  // Time
-      out<<"t= "<<j<<"  "<<"E[0]= "<<me_es[t].Hcurr->M[0].real()<<"  ";
+      out<<"t= "<<j<<"  "<<"E[0]= "<<me_es[t].Hcurr->d[0]<<"  ";
       for(int I=0;I<me_es[t].num_states;I++){
-        out<<"E["<<I<<"]-E[0]= "<<(me_es[t].Hcurr->M[I*me_es[t].num_states+I]-me_es[t].Hcurr->M[0]).real()<<"  ";
+        out<<"E["<<I<<"]-E[0]= "<<(me_es[t].Hcurr->d[I]-me_es[t].Hcurr->d[0])<<"  ";
       }// for I
       out<<endl;
     }// for j
@@ -570,8 +640,63 @@ int namd(boost::python::dict inp_params){
 
     //>>>>> Precompute decoherence rates
     if(params.decoherence>0){
-        cout<<"Starting decoherence rates calculation\n";
-        run_decoherence_rates(params,me_es,me_states,icond);
+        // Choose the window of the trajectory to compute the rates from
+        int w_start = iconds[icond][0];
+        int w_len = params.namdtime;
+        if(params.deco_rates_policy=="rank"){  w_start = iconds[params.myproc][0]; }
+        else if(params.deco_rates_policy=="global"){ w_start = min_indx; w_len = max_indx - min_indx; }
+
+        std::string cache_file = params.scratch_dir+"/decoherence_cache_t"+int2string(w_start)+"_n"+int2string(w_len)
+                               +"_r"+int2string(params.regress_mode)+".bin";
+
+        if(w_start==dd_start && w_len==dd_len){
+          cout<<"Reusing decoherence rates computed for trajectory window t= "<<w_start<<" , length= "<<w_len<<endl;
+          decoherence_data_output(params,icond,dd);
+        }
+        else{
+          // Energies of the window - the rates are computed from them
+          int is_icond_window = (w_start==iconds[icond][0] && w_len==params.namdtime);
+          vector< vector<double> > E;
+          if(is_icond_window){
+            E = vector< vector<double> >(w_len,vector<double>(me_numstates,0.0));
+            for(int t=0;t<w_len;t++){
+              for(int i=0;i<me_numstates;i++){ E[t][i] = me_es[t].Hcurr->d[i]; }
+            }
+          }
+          else{ me_energies(params,me_states,H_batch,en_scl,w_start,w_len,E); }
+
+          std::string cache_key = "";
+          int cache_status = 0;
+          if(params.deco_rates_cache==1){
+            cache_key = decoherence_cache_key(params,me_states,w_start,w_len,E);
+            cache_status = decoherence_cache_read(cache_file,cache_key,dd);
+          }
+
+          if(cache_status==1){
+            cout<<"Decoherence rates are read from cache file "<<cache_file<<endl;
+            decoherence_data_output(params,icond,dd);
+          }
+          else{
+            if(cache_status==-1){
+              cout<<"Cache file "<<cache_file<<" has been computed for a different input and will be overwritten\n";
+            }
+            cout<<"Starting decoherence rates calculation\n";
+            if(is_icond_window){  run_decoherence_rates(params,me_es,me_states,icond,dd);  }
+            else{
+              compute_decoherence_data(params,E,dd);
+              decoherence_data_output(params,icond,dd);
+            }
+
+            // The global window is the same for all processes, so only one of them writes it
+            if(params.deco_rates_cache==1 && (params.deco_rates_policy!="global" || params.myproc==0)){
+              std::string tmp_file = cache_file + ".tmp" + int2string(params.myproc);
+              decoherence_cache_write(tmp_file,cache_key,dd);
+              rename(tmp_file.c_str(),cache_file.c_str());
+            }
+          }
+        }
+        dd_start = w_start;
+        dd_len = w_len;
     }
     //>>>>> Run NA-MD
 //    if(params.runtype=="namd" && params.decoherence==0){
@@ -580,7 +705,8 @@ int namd(boost::python::dict inp_params){
 //    }
 //    if(params.runtype=="namd" && params.decoherence>0){
         cout<<"Starting na-md simulations with (optional) decoherence\n";
-        run_namd1(params,me_es,me_states,icond);
+        run_namd1(params,me_es,me_states,icond,dd);
+        report_elec_steps("time.out",icond,me_es);
 //    }
 
     oe_es.clear();
@@ -12,6 +12,7 @@
 #include <iomanip>
 #include "wfc_export.h"
 #include "namd_export.h"
+#include "fft_export.h"
 #include "matrix.h"
 using namespace std;
 using namespace boost::python;
@@ -64,5 +65,6 @@ BOOST_PYTHON_MODULE(pyxaid_core)
 
     export_wfc();
     export_namd();
+    export_fft();
 }
 
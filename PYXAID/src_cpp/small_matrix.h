@@ -0,0 +1,128 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
+#ifndef small_matrix_h
+#define small_matrix_h
+
+#include "matrix.h"
+#include <cmath>
+
+using namespace std;
+
+/****************************************************************
+ Fixed-size matrices for small numbers of states. The storage is
+ on the stack and all loop bounds are compile-time constants, so
+ the kernels below are unrolled by the compiler and nothing is
+ allocated. The callers dispatch to an instantiation for the common
+ sizes (2, 4, 8, 16, 32) and use the dynamic matrix code otherwise.
+****************************************************************/
+
+template<int N>
+class small_matrix{
+public:
+  complex<double> M[N*N];  // Mij = M[i*N+j]
+
+  void load(const complex<double>* x){ for(int i=0;i<N*N;i++){ M[i] = x[i]; } }
+  void store(complex<double>* x) const { for(int i=0;i<N*N;i++){ x[i] = M[i]; } }
+  void load_identity(){
+    for(int i=0;i<N*N;i++){ M[i] = 0.0; }
+    for(int i=0;i<N;i++){ M[i*N+i] = 1.0; }
+  }
+};
+
+
+template<int N>
+void small_eigen(small_matrix<N>& A,double* Eval,small_matrix<N>& Evec,double EPS){
+/****************************************************************
+  Cyclic Jacobi method for Hermitian A:  A = Evec * Eval * Evec.H()
+  Each rotation J = D * P first makes A_pq real by the phase
+  D_qq = exp(-i*arg(A_pq)) and then annihilates it by the usual
+  real rotation P. Sweeps are repeated until the off-diagonal
+  part is below EPS relative to the whole matrix. A is destroyed
+*****************************************************************/
+  Evec.load_identity();
+
+  double nrm = 0.0;
+  for(int i=0;i<N*N;i++){ nrm += std::norm(A.M[i]); }
+
+  for(int sweep=0;sweep<50;sweep++){
+    double off = 0.0;
+    for(int p=0;p<N;p++){ for(int q=p+1;q<N;q++){ off += std::norm(A.M[p*N+q]); } }
+    if(off<=EPS*EPS*nrm){ break; }
+
+    for(int p=0;p<N;p++){
+      for(int q=p+1;q<N;q++){
+        double r = abs(A.M[p*N+q]);
+        if(r==0.0){ continue; }
+
+        complex<double> e = A.M[p*N+q]/r;   // exp(i*arg(A_pq))
+        double app = A.M[p*N+p].real();
+        double aqq = A.M[q*N+q].real();
+        double theta = (aqq - app)/(2.0*r);
+        double t = 1.0/(fabs(theta) + sqrt(theta*theta + 1.0));  if(theta<0.0){ t = -t; }
+        double c = 1.0/sqrt(t*t + 1.0);
+        double s = t*c;
+
+        // J_pp = c, J_pq = s, J_qp = -s*e^*, J_qq = c*e^*
+        complex<double> jqp = -s*std::conj(e);
+        complex<double> jqq =  c*std::conj(e);
+
+        // A = A * J,  Evec = Evec * J
+        for(int k=0;k<N;k++){
+          complex<double> akp = A.M[k*N+p], akq = A.M[k*N+q];
+          A.M[k*N+p] = akp*c + akq*jqp;
+          A.M[k*N+q] = akp*s + akq*jqq;
+
+          complex<double> vkp = Evec.M[k*N+p], vkq = Evec.M[k*N+q];
+          Evec.M[k*N+p] = vkp*c + vkq*jqp;
+          Evec.M[k*N+q] = vkp*s + vkq*jqq;
+        }
+        // A = J.H() * A
+        for(int k=0;k<N;k++){
+          complex<double> apk = A.M[p*N+k], aqk = A.M[q*N+k];
+          A.M[p*N+k] = c*apk + std::conj(jqp)*aqk;
+          A.M[q*N+k] = s*apk + std::conj(jqq)*aqk;
+        }
+
+        A.M[p*N+p] = app - t*r;
+        A.M[q*N+q] = aqq + t*r;
+        A.M[p*N+q] = A.M[q*N+p] = 0.0;
+      }// for q
+    }// for p
+  }// for sweep
+
+  for(int i=0;i<N;i++){ Eval[i] = A.M[i*N+i].real(); }
+}
+
+template<int N>
+matrix small_exp(matrix& m1,complex<double> scl,double eps){
+/****************************************************************
+  exp(m1*scl) for Hermitian N x N m1, see exp(matrix&,...)
+*****************************************************************/
+  small_matrix<N> A,Evec;
+  double Eval[N];
+  complex<double> ex[N];
+
+  A.load(m1.M);
+  small_eigen<N>(A,Eval,Evec,eps);
+  for(int k=0;k<N;k++){ ex[k] = exp(Eval[k]*scl); }
+
+  matrix res(N,N);
+  for(int i=0;i<N;i++){
+    for(int j=0;j<N;j++){
+      complex<double> sum(0.0,0.0);
+      for(int k=0;k<N;k++){ sum += Evec.M[i*N+k]*ex[k]*std::conj(Evec.M[j*N+k]); }
+      res.M[i*N+j] = sum;
+    }
+  }
+  return res;
+}
+
+
+#endif // small_matrix_h
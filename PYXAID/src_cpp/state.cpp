@@ -62,7 +62,7 @@ int delta(vector<int>& A,vector<int>& B,int& a,int& b){
   sz = _C.size();
 
   int nexc = 0; // Number of excitations between 2 states
-  for(i=0;i<sz;i++){
+  for(int i=0;i<sz;i++){
     int n_in_a,n_in_b;
     vector<int> tmpa,tmpb;
     n_in_a = num_in_vector(_C[i],_A,tmpa);
@@ -101,7 +101,7 @@ int me_state::calculate_Exc(vector<int>& Exc_i,vector<int>& Exc_j,vector<double>
 
   // Shift given (1-electron orbitals) - "Scissor" operator
   sz = shift_E.size();
-  for(i=0;i<Nel;i++){
+  for(int i=0;i<Nel;i++){
     for(int n=0;n<sz;n++){
       if( abs(actual_state[i])==shift_i[n] ){ Exc += shift_E[n]; }
     }// for n
@@ -185,7 +185,7 @@ void input_states(boost::python::dict params,vector<me_state>& states){
 
 
   // Now read the microstates and create corresponding determinants
-  for(i=0;i<len(lkeys);i++){
+  for(int i=0;i<len(lkeys);i++){
     std::string s1;
     s1 = extract<std::string>(lkeys[i]);
 
@@ -200,7 +200,7 @@ void input_states(boost::python::dict params,vector<me_state>& states){
 
 
   // Read other orbital/determinant parameters
-  for(i=0;i<len(lkeys);i++){
+  for(int i=0;i<len(lkeys);i++){
     std::string s1;
     s1 = extract<std::string>(lkeys[i]);
 
@@ -218,7 +218,7 @@ void input_states(boost::python::dict params,vector<me_state>& states){
   }// for i  
 
 
-  for(i=0;i<len(lkeys);i++){
+  for(int i=0;i<len(lkeys);i++){
     std::string s1;
     s1 = extract<std::string>(lkeys[i]);
 
@@ -238,7 +238,7 @@ void input_states(boost::python::dict params,vector<me_state>& states){
   }// for i
 
 
-  for(i=0;i<len(lkeys);i++){
+  for(int i=0;i<len(lkeys);i++){
     std::string s1;
     s1 = extract<std::string>(lkeys[i]);
 
@@ -260,18 +260,18 @@ void input_states(boost::python::dict params,vector<me_state>& states){
 
   // Now calculate the Exc corrections for all states, based on extracted parameters Exc_i, Exc_j and Exc
   int sz = states.size();
-  for(i=0;i<sz;i++){   states[i].calculate_Exc(Exc_i,Exc_j,Exc,shift_i,shift_E);   }
+  for(int i=0;i<sz;i++){   states[i].calculate_Exc(Exc_i,Exc_j,Exc,shift_i,shift_E);   }
 
 
   // Debugging
   cout<<"Number of basis multi-electron states is: "<<sz<<endl;
-  for(i=0;i<sz;i++){
+  for(int i=0;i<sz;i++){
     cout<<"State "<<i<<" : "; states[i].show_state(); cout<<" Exc = "<<states[i].Exc<<endl;
   }
 
   // Now set NAC scalings
   int sz1 = nac_scl.size(); // total number of all pairs to be scales
-  for(i=0;i<sz;i++){        // For each state i
+  for(int i=0;i<sz;i++){        // For each state i
     for(int k=0;k<sz1;k++){ // check all pairs j
       if(nac_scl_i[k]==i){  // this will scale d[nac_scl_i[k]==i][nac_scl_j[k]]
         // Check if state nac_scl_j[k] is already in list
@@ -295,7 +295,7 @@ void input_states(boost::python::dict params,vector<me_state>& states){
   }// for i
 
   // Now print all corrections:
-  for(i=0;i<sz;i++){
+  for(int i=0;i<sz;i++){
     cout<<"Couplings of the macrostate "<<i<<" will be scaled for the following states:\n";
     for(int k=0;k<states[i].nac_scl.size();k++){
       cout<<"     "<<states[i].nac_scl_indx[k]<<"   "<<states[i].nac_scl[k]<<endl;
@@ -327,7 +327,7 @@ void input_iconds(boost::python::dict params, int me_numstates, vector<vector<in
     }// iconds-micro
   }//for i
 
-  for(i=0;i<iconds.size();i++){
+  for(int i=0;i<iconds.size();i++){
     if(iconds[i][1]<0){ cout<<"Error: Minimal excitation state is 0 (0 - is a ground state)\n"; exit(0); }
     if(iconds[i][1]>me_numstates){ cout<<"Error: The initial excitation state must be in range [ 0 , "<<me_numstates<<")\n"; exit(0); }
   }
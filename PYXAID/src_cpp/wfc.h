@@ -40,39 +40,50 @@ void get_value(T& val,char* memblock,int& pos){
 class MO{
 
 public:
-  int npw;                        // number of plane waves in MO expansion
+  int npw;                        // number of plane waves in MO expansion, 0 - MO without coefficients (not read)
   double energy;                  // energy of this orbital (eigenvalue)
   double gweight;
   double fweight;
-//  vector< complex<float> > coeff_f; // expansion coefficients
+  int prec;                        // storage of the coefficients: 0 - double (coeff), 1 - float (coeff_f)
+  vector< complex<float> > coeff_f; // coefficients in single precision
   vector< complex<double> > coeff; // coefficients in double precision
 
   // Constructor
-  MO(){ npw = 0;  energy = 0.0; gweight = 0.0; fweight = 0.0; }
+  MO(){ npw = 0;  energy = 0.0; gweight = 0.0; fweight = 0.0; prec = 0; }
   MO(int _npw){ 
     npw = _npw;
-    energy = 0.0; gweight = 0.0; fweight = 0.0;
+    energy = 0.0; gweight = 0.0; fweight = 0.0; prec = 0;
     coeff = vector<complex<double> >(npw,complex<double>(0.0,0.0));
   }
   // Copy constructor
 //  MO(const& MO);
+#if __cplusplus >= 201103L
+  // The user-declared destructor suppresses the implicit move operations
+  MO(const MO&) = default;
+  MO(MO&&) = default;
+  MO& operator=(const MO&) = default;
+  MO& operator=(MO&&) = default;
+#endif
 
   // Destructor
-  ~MO(){ if(coeff.size()>0){ coeff.clear(); } npw = 0; }
+  ~MO(){ if(coeff.size()>0){ coeff.clear(); } if(coeff_f.size()>0){ coeff_f.clear(); } npw = 0; }
 
   // Operators
   MO operator-();                 // Negation;
-  MO operator+(MO ob);
-  MO operator-(MO ob);
-  void operator+=(MO ob);
-  void operator-=(MO ob);
+  MO operator+(const MO& ob);
+  MO operator-(const MO& ob);
+  void operator+=(const MO& ob);
+  void operator-=(const MO& ob);
   MO operator/(double num);
   MO operator/(complex<double> num);
 
 
   // Methods
+  complex<double> c(int i) const { return (prec==1)? complex<double>(coeff_f[i]) : coeff[i]; } // i-th coefficient
+  void set_prec(int _prec);
   MO conj();
   void normalize();
+  void normalize_gamma(); // coeff is the half set of the gamma-point wfc
   void complete();  // add complex conjugate part of the wavefunction
 
   // Friends
@@ -114,7 +125,9 @@ public:
   // Methods
   void complete();
   void normalize();
+  void normalize_gamma();
   void transform(matrix&);
+  void set_prec(int _prec);
 };
 
 
@@ -125,7 +138,9 @@ class wfc{
 public:
   // Info
   int nspin;                // type of the spin-polarization used in calculations
-  int gamma_only;           // gamma trick:  =1 (true), =0 (false)
+  int gamma_only;           // gamma trick:  =1 (true), =0 (false). With =1 the MOs keep only half of the plane waves
+                            // (G=0 first, c(-G) = conj(c(G))) and all overlaps are computed on this half set
+  int prec;                 // storage of the MO coefficients: =0 double, =1 float (sums are still done in double)
   int natoms;               // number of atoms
   double tpiba;             // units of the lattice vectors (reciprocal)
   double alat;              // units of the lattice vectors (real)
@@ -147,10 +162,10 @@ public:
   
 
   // Constructor
-  wfc(){ nkpts = 0; nbands = 0; npw = 0; is_allocated = 0; }
-  wfc(int _nkpts){ nkpts = _nkpts; nbands = 0; npw = 0; kpts = vector<K_point>(nkpts,K_point()); is_allocated = 1; }
-  wfc(int _nkpts,int _nbnds){ nkpts = _nkpts; nbands = _nbnds; npw = 0; kpts = vector<K_point>(nkpts,K_point(nbands)); is_allocated = 2; }
-  wfc(int _nkpts,int _nbnds,int _npw){nkpts = _nkpts; nbands = _nbnds; npw = _npw; kpts = vector<K_point>(nkpts,K_point(nbands,npw)); is_allocated = 3; }
+  wfc(){ nkpts = 0; nbands = 0; npw = 0; is_allocated = 0; prec = 0; gamma_only = 0; }
+  wfc(int _nkpts){ nkpts = _nkpts; nbands = 0; npw = 0; kpts = vector<K_point>(nkpts,K_point()); is_allocated = 1; prec = 0; gamma_only = 0; }
+  wfc(int _nkpts,int _nbnds){ nkpts = _nkpts; nbands = _nbnds; npw = 0; kpts = vector<K_point>(nkpts,K_point(nbands)); is_allocated = 2; prec = 0; gamma_only = 0; }
+  wfc(int _nkpts,int _nbnds,int _npw){nkpts = _nkpts; nbands = _nbnds; npw = _npw; kpts = vector<K_point>(nkpts,K_point(nbands,npw)); is_allocated = 3; prec = 0; gamma_only = 0; }
   wfc(wfc& wfc1,int min1,int max1, wfc& wfc2,int min2,int max2);
 
   // Destructor
@@ -166,7 +181,12 @@ public:
   void QE_read_acsii_grid(std::string filename);
   void QE_read_acsii_index(std::string filename);
 
+  // VASP methods
+  void VASP_read_wfc(std::string filename);
+  void VASP_read_wfc(std::string filename,int k,int minband,int maxband);
+
   // Common methods
+  void set_prec(int _prec);
   void complete();
   void normalize();
   void transform(int k,matrix&);
@@ -178,6 +198,7 @@ public:
 
 
 // Functions using the arguments of wfc type
+void mo_overlaps(K_point& kp1,K_point& kp2,int minband,int maxband,int gamma,matrix& S); // S(i,j) = <kp1.mo[i]|kp2.mo[j]>
 void overlap(wfc& wfc1,int k1,int minband,int maxband,std::string filename);
 void energy(wfc& wfc1,int k,int minband,int maxband,std::string filename);
 void nac(wfc& wfc1,wfc& wfc2,int k1,int k2,int minband,int maxband,double dt,std::string filename);
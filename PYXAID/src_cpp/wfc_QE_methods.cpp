@@ -54,6 +54,7 @@ void wfc::QE_read_binary_wfc(std::string filename,int _nkpts,int _nbands,int _to
         for(int i=0;i<kpts[ikpt].mo[iband].npw;i++){
           get_value< std::complex<double> >(c,memblock,pos); kpts[ikpt].mo[iband].coeff[i] = c;
         }
+        if(prec==1){ kpts[ikpt].mo[iband].set_prec(1); } // float storage
 //        pos += ((int)rdum - kpts[ikpt].mo[iband].npw*sizeof( std::complex<float>));
       }// for bands
 
@@ -114,7 +115,7 @@ void wfc::QE_read_acsii_wfc(std::string filename){
   }
 
   // Now finally get the coefficients 
-  for(k=0;k<nkpts;k++){
+  for(int k=0;k<nkpts;k++){
     for(int band=0;band<nbands;band++){
       for(int pw=0;pw<npw;pw++){
 
@@ -128,6 +129,7 @@ void wfc::QE_read_acsii_wfc(std::string filename){
         kpts[k].mo[band].coeff[pw] = complex<double>(re,im);
 
       }//for npw
+      if(prec==1){ kpts[k].mo[band].set_prec(1); } // float storage
     }//for band
   }// for k
  
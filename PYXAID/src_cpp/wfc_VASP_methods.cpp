@@ -1,103 +1,137 @@
+/***********************************************************
+ * Copyright (C) 2013 Alexey V. Akimov
+ * This file is distributed under the terms of the
+ * GNU General Public License as published by the
+ * Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ * http://www.gnu.org/copyleft/gpl.txt
+***********************************************************/
+
 #include "wfc.h"
 
+/*****************************************************************
+  WAVECAR is a direct-access file: all records have the same length
+  rdum (in bytes), given in the first record
+
+   record 0: rdum, rispin, rtag
+   record 1: nkpts, nbands, emax, lattice vectors (9 numbers)
+   then for every k-point:
+     1-st  record: npl, kpt(3), (eig, gweight, fweight) for every band
+     next nbands records: coefficients of the bands (npl entries each)
+
+  rtag = 45200 - coefficients are complex<float>, rtag = 45210 - complex<double>
+  With rispin = 2 the records of the second spin channel follow those of
+  the first one, only the first channel is read here
+*****************************************************************/
+
+
 void wfc::VASP_read_wfc(std::string filename){
+// Read all k-points and all bands
+  VASP_read_wfc(filename,-1,0,-1);
+}
 
-  ifstream::pos_type size;
-  char * memblock;
+void wfc::VASP_read_wfc(std::string filename,int k,int minband,int maxband){
+// Read the coefficients of the bands [minband,maxband] (maxband = -1 - up to the last band)
+// of the k-point with index k (k = -1 - all k-points). The file is not loaded in memory:
+// we seek to the needed records and decode them one band at a time, so the memory used is
+// only that of the requested bands. For all k-points and bands the header data (energies, weights,
+// K_point::npw) are set, while the MOs outside of the requested range are left without coefficients
+// and with npw = 0, so that they are skipped by normalize(), complete(), restore() and the overlaps
+// The coefficients are stored in float if prec = 1 (see set_prec), in double otherwise
 
   ifstream file;
-  file.open(filename.c_str(), ios::in|ios::binary|ios::ate);
-  if (file.is_open())
-  {
-    // First - read all file
-    size = file.tellg();
-    memblock = new char [size];
-    file.seekg (0, ios::beg);
-    file.read (memblock, size);
-    file.close();
-
-//    cout<<"size of the file = "<<size<<" bytes\n";
-
-    // Read first record
-    int pos = 0;  // position in file (in bytes)
-    double tmp;
-    double rdum,rispin,rtag;
-
-//================== First record ========================
-    get_value<double>(rdum,memblock,pos);
-    get_value<double>(rispin,memblock,pos);
-    get_value<double>(rtag,memblock,pos);
-
-    pos += ((int)rdum - 3*sizeof(double));
-
-//================= Second record ========================
-    double inkpt, inband,emax;
-    get_value<double>(inkpt,memblock,pos);      nkpts = (int)inkpt;
-    get_value<double>(inband,memblock,pos);     nbands = (int)inband;
-    get_value<double>(emax,memblock,pos);
-    kpts = std::vector<K_point>(nkpts,K_point());
-
-    vector<double> A(9,0.0); for(int i=0;i<9;i++){ get_value<double>(A[i],memblock,pos); }
-
-    pos += ((int)rdum - 12*sizeof(double));
-
-//=============== Other records ==========================
-//   1-st k-point
-//              1-st  record: npl(1), kpt, eig,gweight,fweight
-//     1-st band
-//              2-nd  record: coeff for 1-st band (npl entries)
-//     2-nd band
-//              3-rd  record: coeff for 2-nd band (npl entries)
-//      ...
-//     nband-th band
-//              (nband+1)-th record: coeff for nband-th band (npl entries)
-//
-//
-//  2-nd k-point
-//             (nband+2)-th record: npl(2), kpt, eig, gweight, fweight
-//     1-st band
-//             (nband+3)-th record: coeff for 1-st band (npl(2) entries)
-// ... etc.
-
-
-    double npl;
-    for(int ikpt=0;ikpt<nkpts;ikpt++){
-      kpts[ikpt].nbands = nbands;
-      kpts[ikpt].mo = std::vector<MO>(nbands,MO());
-
-      //============= 1-st sub-record ==========================
-      get_value<double>(npl,memblock,pos);
-      get_value<double>(tmp,memblock,pos); kpts[ikpt].kx = (int)tmp;
-      get_value<double>(tmp,memblock,pos); kpts[ikpt].ky = (int)tmp;
-      get_value<double>(tmp,memblock,pos); kpts[ikpt].kz = (int)tmp;
-
-      for(int iband=0;iband<kpts[ikpt].nbands;iband++){
-        kpts[ikpt].mo[iband].npw = (int)npl;
-        get_value<double>(kpts[ikpt].mo[iband].energy,memblock,pos);
-        get_value<double>(kpts[ikpt].mo[iband].gweight,memblock,pos);
-        get_value<double>(kpts[ikpt].mo[iband].fweight,memblock,pos);
-      }// for bands
-
-      pos += ((int)rdum - (3*kpts[ikpt].nbands+4)*sizeof(double));
-
-      for(iband=0;iband<kpts[ikpt].nbands;iband++){
-      //=============== iband-th sub-sub-record ================
-        kpts[ikpt].mo[iband].coeff = std::vector< complex<double> >(kpts[ikpt].mo[iband].npw,std::complex<double>(0.0,0.0));
-        for(int i=0;i<kpts[ikpt].mo[iband].npw;i++){
-          std::complex<float> tmp;
-          get_value< std::complex<float> >(tmp,memblock,pos);
-          kpts[ikpt].mo[iband].coeff[i] = tmp;
+  file.open(filename.c_str(), ios::in|ios::binary);
+  if(!file.is_open()){ cout << "Unable to open file"<<filename<<"\n"; return; }
+
+  double rdum,rispin,rtag;
+  double inkpt,inband,emax;
+
+  //================== First record ========================
+  file.read((char*)&rdum,sizeof(double));
+  file.read((char*)&rispin,sizeof(double));
+  file.read((char*)&rtag,sizeof(double));
+  std::streamoff reclen = (std::streamoff)rdum;
+
+  int is_single;
+  if((int)rtag==45200){ is_single = 1; }
+  else if((int)rtag==45210){ is_single = 0; }
+  else{ cout<<"Error in VASP_read_wfc: unknown WAVECAR format (rtag = "<<rtag<<")\nExiting...\n"; exit(0); }
+
+  //================= Second record ========================
+  file.seekg(reclen, ios::beg);
+  file.read((char*)&inkpt,sizeof(double));   nkpts = (int)inkpt;
+  file.read((char*)&inband,sizeof(double));  nbands = (int)inband;
+  file.read((char*)&emax,sizeof(double));
+
+  if(k<-1 || k>=nkpts){ cout<<"Error in VASP_read_wfc : k-point index must be in [0,"<<nkpts-1<<"] or -1, given "<<k<<endl; exit(0); }
+  if(maxband==-1){ maxband = nbands - 1; }
+  if(minband<0){ cout<<"Error in VASP_read_wfc : minimal band index is 0, given "<<minband<<endl; exit(0); }
+  if(maxband>=nbands){ cout<<"Error in VASP_read_wfc : maximal band index is "<<nbands-1<<", given "<<maxband<<endl; exit(0); }
+
+  kpts = std::vector<K_point>(nkpts,K_point());
+
+  //=============== Other records ==========================
+  vector<double> kbuf(4+3*nbands);
+  vector< complex<float> > cbuf_f;
+  vector< complex<double> > cbuf_d;
+
+  for(int ikpt=0;ikpt<nkpts;ikpt++){
+    std::streamoff rec = 2 + (std::streamoff)ikpt*(nbands+1); // header record of this k-point
+    kpts[ikpt].nbands = nbands;
+    kpts[ikpt].mo = std::vector<MO>(nbands,MO());
+
+    //============= 1-st sub-record ==========================
+    file.seekg(rec*reclen, ios::beg);
+    file.read((char*)&kbuf[0],kbuf.size()*sizeof(double));
+    if(!file){ cout<<"Error in VASP_read_wfc: unexpected end of file "<<filename<<"\nExiting...\n"; exit(0); }
+
+    int npl = (int)kbuf[0];
+    kpts[ikpt].npw = npl;
+    kpts[ikpt].kx = (int)kbuf[1];
+    kpts[ikpt].ky = (int)kbuf[2];
+    kpts[ikpt].kz = (int)kbuf[3];
+
+    for(int iband=0;iband<nbands;iband++){
+      kpts[ikpt].mo[iband].energy  = kbuf[4+3*iband];
+      kpts[ikpt].mo[iband].gweight = kbuf[5+3*iband];
+      kpts[ikpt].mo[iband].fweight = kbuf[6+3*iband];
+    }// for bands
+
+    if(k!=-1 && ikpt!=k){ continue; }
+
+    //=============== iband-th sub-sub-record ================
+    for(int iband=minband;iband<=maxband;iband++){
+      MO& mo = kpts[ikpt].mo[iband];
+      mo.npw = npl;
+      file.seekg((rec+1+iband)*reclen, ios::beg);
+
+      if(prec==1){
+        // float storage: single precision records are read in place
+        mo.prec = 1;
+        mo.coeff_f = std::vector< complex<float> >(npl);
+        if(is_single){ file.read((char*)&mo.coeff_f[0],npl*sizeof(complex<float>)); }
+        else{
+          cbuf_d.resize(npl);
+          file.read((char*)&cbuf_d[0],npl*sizeof(complex<double>));
+          for(int i=0;i<npl;i++){ mo.coeff_f[i] = complex<float>(cbuf_d[i]); }
         }
-        pos += ((int)rdum - kpts[ikpt].mo[iband].npw*sizeof( std::complex<float>));
-      }// for bands
-
-    }// for k-points
+      }
+      else{
+        mo.coeff = std::vector< complex<double> >(npl);
+        if(is_single){
+          cbuf_f.resize(npl);
+          file.read((char*)&cbuf_f[0],npl*sizeof(complex<float>));
+          for(int i=0;i<npl;i++){ mo.coeff[i] = cbuf_f[i]; }
+        }
+        else{ file.read((char*)&mo.coeff[0],npl*sizeof(complex<double>)); }
+      }
+      if(!file){ cout<<"Error in VASP_read_wfc: unexpected end of file "<<filename<<"\nExiting...\n"; exit(0); }
+    }// for bands
 
-    // Free memory
-    delete[] memblock;
-  }
-  else{ cout << "Unable to open file"<<filename<<"\n"; }
+  }// for k-points
 
+  file.close();
 
 }
 
+
@@ -12,36 +12,43 @@
 using namespace std;
 
 //======================= MO class methods ========================
+// The coefficients are in coeff (prec = 0) or in coeff_f (prec = 1), all the
+// operations below work with the storage in use. Sums are done in double
 
 MO MO::operator-(){
   MO res; res = *this;
-  for(int i=0;i<npw;i++){ res.coeff[i] = -coeff[i]; }
+  if(prec==1){ for(int i=0;i<npw;i++){ res.coeff_f[i] = -coeff_f[i]; } }
+  else{ for(int i=0;i<npw;i++){ res.coeff[i] = -coeff[i]; } }
   return res;
 }
-MO MO::operator+(MO m){
+MO MO::operator+(const MO& m){
   MO res; res = *this;
-  for(int i=0;i<npw;i++){ res.coeff[i] = coeff[i] + m.coeff[i]; }
+  res += m;
   return res;
 }
-MO MO::operator-(MO m){
+MO MO::operator-(const MO& m){
   MO res; res = *this;
-  for(int i=0;i<npw;i++){ res.coeff[i] = coeff[i] - m.coeff[i]; }
+  res -= m;
   return res;
 }
-void MO::operator+=(MO m){
-  for(int i=0;i<npw;i++){ coeff[i] += m.coeff[i]; }
+void MO::operator+=(const MO& m){
+  if(prec==1){ for(int i=0;i<npw;i++){ coeff_f[i] = complex<float>(c(i) + m.c(i)); } }
+  else{ for(int i=0;i<npw;i++){ coeff[i] += m.c(i); } }
 }
-void MO::operator-=(MO m){
-  for(int i=0;i<npw;i++){ coeff[i] -= m.coeff[i]; }
+void MO::operator-=(const MO& m){
+  if(prec==1){ for(int i=0;i<npw;i++){ coeff_f[i] = complex<float>(c(i) - m.c(i)); } }
+  else{ for(int i=0;i<npw;i++){ coeff[i] -= m.c(i); } }
 }
 MO MO::operator/(double num){
   MO res; res = *this;
-  for(int i=0;i<npw;i++){ res.coeff[i] /= num;  }
+  if(prec==1){ for(int i=0;i<npw;i++){ res.coeff_f[i] = complex<float>(c(i)/num); } }
+  else{ for(int i=0;i<npw;i++){ res.coeff[i] /= num;  } }
   return res;
 }
 MO MO::operator/(complex<double> num){
   MO res; res = *this;
-  for(int i=0;i<npw;i++){ res.coeff[i] /= num; }
+  if(prec==1){ for(int i=0;i<npw;i++){ res.coeff_f[i] = complex<float>(c(i)/num); } }
+  else{ for(int i=0;i<npw;i++){ res.coeff[i] /= num; } }
   return res;
 }
 
@@ -57,52 +64,88 @@ MO::MO(const& MO mo){
 }
 */
 
+void MO::set_prec(int _prec){
+// Moves the coefficients to the storage _prec: 0 - double (coeff), 1 - float (coeff_f)
+// The memory of the other storage is released
+  if(_prec!=0 && _prec!=1){ cout<<"Error in MO::set_prec: allowed values are 0 (double) and 1 (float), given "<<_prec<<endl; exit(0); }
+  if(_prec==prec){ return; }
+  if(_prec==1){
+    coeff_f = vector< complex<float> >(coeff.begin(),coeff.end());
+    vector< complex<double> >().swap(coeff);
+  }
+  else{
+    coeff = vector< complex<double> >(coeff_f.begin(),coeff_f.end());
+    vector< complex<float> >().swap(coeff_f);
+  }
+  prec = _prec;
+}
+
 MO MO::conj(){
 // Return MO which is conjugate to original one
   MO res(npw);
   res.energy = energy; res.gweight = gweight; res.fweight = fweight;
-  for(int i=0;i<npw;i++){ res.coeff[i] = std::conj(coeff[i]); }
+  for(int i=0;i<npw;i++){ res.coeff[i] = std::conj(c(i)); }
+  res.set_prec(prec);
   return res;
 }
 
-void MO::normalize(){
+template<class T>
+void normalize_coeff(vector< complex<T> >& coeff,int npw,int gamma){
+// gamma = 1: coeff is the half set of the gamma-point wfc (G=0 first), the other
+// half c(-G) = conj(c(G)) contributes to the norm as if the wfc were completed
   double norm = 0.0;
-  for(int i=0;i<npw;i++){norm += (std::conj(coeff[i]) * coeff[i] ).real();  }
+  for(int i=0;i<npw;i++){ complex<double> x = coeff[i]; norm += (std::conj(x) * x).real();  }
+  if(gamma){ complex<double> x = coeff[0]; norm = 2.0*norm - (std::conj(x) * x).real(); }
   norm = sqrt(1.0/norm);
-  for(i=0;i<npw;i++){ coeff[i] *= norm; }
+  for(int i=0;i<npw;i++){ coeff[i] = complex<T>(complex<double>(coeff[i])*norm); }
 }
 
-void MO::complete(){
+void MO::normalize(){
+  if(npw==0){ return; }  // no coefficients
+  if(prec==1){ normalize_coeff(coeff_f,npw,0); }
+  else{ normalize_coeff(coeff,npw,0); }
+}
+
+void MO::normalize_gamma(){
+  if(npw==0){ return; }  // no coefficients
+  if(prec==1){ normalize_coeff(coeff_f,npw,1); }
+  else{ normalize_coeff(coeff,npw,1); }
+}
+
+template<class T>
+void complete_coeff(vector< complex<T> >& coeff,int npw){
   // Complete the wfc by adding the complex conjugate part
-  // First find the index of the G=0
-  double tol = 1e-10;
-  int indx=0;  
-  // The general procedure - find the coefficient for G = (0,0,0)
-  // for(int i=0;i<npw;i++){  if( fabs(::imag(coeff[i]))<tol) { indx = i; break; }  }
-  // In QE this is simple: indx = 0 corresponds to G=0
+  // In QE the coefficient with index 0 corresponds to G=0
 
   // Now add remaining part
   coeff.resize(2*npw-1);
-  double norm = (std::conj(coeff[0]) * coeff[0] ).real();
+  complex<double> x = coeff[0];
+  double norm = (std::conj(x) * x).real();
   for(int i=1;i<npw;i++){
-    coeff[npw+i] = std::conj(coeff[i]); 
-    norm += 2.0*(std::conj(coeff[i]) * coeff[i] ).real();
+    coeff[npw-1+i] = std::conj(coeff[i]); 
+    x = coeff[i];
+    norm += 2.0*(std::conj(x) * x).real();
   }
 
-  // Update the number of the planewaves in new (completed) wfc
-  npw =  2*npw - 1;
-
   // Finally, normalize the completed wfc
   norm = sqrt(1.0/norm);
-  for(i=0;i<npw;i++){ coeff[i] *= norm; }
+  for(int i=0;i<2*npw-1;i++){ coeff[i] = complex<T>(complex<double>(coeff[i])*norm); }
+}
+
+void MO::complete(){
+  if(npw==0){ return; }  // no coefficients
+  if(prec==1){ complete_coeff(coeff_f,npw); }
+  else{ complete_coeff(coeff,npw); }
 
-    
+  // Update the number of the planewaves in new (completed) wfc
+  npw =  2*npw - 1;
 }
 
 template<class T>
 MO multiply(T& f,  const MO& m1){
   MO res; res = m1;
-  for(int i=0;i<res.npw;i++){ res.coeff[i] *= f; }
+  if(res.prec==1){ for(int i=0;i<res.npw;i++){ res.coeff_f[i] = complex<float>(res.c(i)*complex<double>(f)); } }
+  else{ for(int i=0;i<res.npw;i++){ res.coeff[i] *= f; } }
   return res;
 }
 
@@ -118,7 +161,8 @@ MO operator*(const MO& m1, const complex<float>  &f){ return multiply<const comp
 complex<double> operator*(const MO& m1,  const MO& m2){
   complex<double> res(0.0,0.0);
   if(m1.npw!=m2.npw){ cout<<"Error: Can not multiply MOs with different basis sizes\n"; exit(0); }
-  else{   for(int i=0;i<m1.npw;i++){ res += m1.coeff[i] * m2.coeff[i];}  }
+  else if(m1.prec==0 && m2.prec==0){   for(int i=0;i<m1.npw;i++){ res += m1.coeff[i] * m2.coeff[i];}  }
+  else{   for(int i=0;i<m1.npw;i++){ res += m1.c(i) * m2.c(i);}  }
   return res;
 }
 //==================== K_point methods ================================
@@ -149,7 +193,7 @@ K_point::K_point(K_point& k1,int min1,int max1, K_point& k2,int min2,int max2){
 
   if(max1>=min2){ cout<<"Warning in K_point constructor: There are several identical bands (MO) in given K_point\n"; }
   for(int i=min1;i<=max1;i++){  mo.push_back(k1.mo[i]); }
-  for(    i=min2;i<=max2;i++){  mo.push_back(k2.mo[i]); }
+  for(int i=min2;i<=max2;i++){  mo.push_back(k2.mo[i]); }
 
 }
 
@@ -174,24 +218,39 @@ void K_point::normalize(){
   for(int i=0;i<nbands;i++){  mo[i].normalize();  }
 }
 
+void K_point::normalize_gamma(){
+  for(int i=0;i<nbands;i++){  mo[i].normalize_gamma();  }
+}
+
 
 void K_point::transform(matrix& T){
 // T - is nbands x nbands matrix which mixes original MOs to make new LC of MOs
+// The new MOs are accumulated in double and stored with the precision of the original ones
+// The MOs without coefficients (npw = 0) are left as they are and do not contribute to the others
   vector<MO> tmp_mo = mo;
+  vector< complex<double> > tmp;
   for(int i=0;i<nbands;i++){
-    MO tmp(mo[i].npw); 
-    tmp.energy = mo[i].energy;
-    tmp.gweight = mo[i].gweight;
-    tmp.fweight = mo[i].fweight;
+    int n = mo[i].npw;
+    if(n==0){ continue; }
+    tmp.assign(n,complex<double>(0.0,0.0));
 
     for(int j=0;j<nbands;j++){
-      tmp += T.M[i*nbands+j] * mo[j];
+      if(mo[j].npw==0){ continue; }
+      complex<double> t = T.M[i*nbands+j];
+      if(mo[j].prec==1){ for(int g=0;g<n;g++){ tmp[g] += t * complex<double>(mo[j].coeff_f[g]); } }
+      else{ for(int g=0;g<n;g++){ tmp[g] += t * mo[j].coeff[g]; } }
     }
-    tmp_mo[i] = tmp;
+
+    if(tmp_mo[i].prec==1){ for(int g=0;g<n;g++){ tmp_mo[i].coeff_f[g] = complex<float>(tmp[g]); } }
+    else{ tmp_mo[i].coeff = tmp; }
   }
   mo = tmp_mo;
 }
 
+void K_point::set_prec(int _prec){
+  for(int i=0;i<nbands;i++){  mo[i].set_prec(_prec);  }
+}
+
 //===================== wfc class methods ============================
 
 wfc::wfc(wfc& w1,int min1,int max1, wfc& w2,int min2,int max2){
@@ -202,6 +261,7 @@ wfc::wfc(wfc& w1,int min1,int max1, wfc& w2,int min2,int max2){
 // Takes all parameters from the first wfc
   nspin = w1.nspin;
   gamma_only = w1.gamma_only;
+  prec = w1.prec;
   natoms = w1.natoms;
   tpiba = w1.tpiba;
   alat = w1.alat;
@@ -257,13 +317,27 @@ wfc::wfc(const wfc& w1){
 }
 */
 
+void wfc::set_prec(int _prec){
+// Storage of the MO coefficients: 0 - double, 1 - float. The MOs read afterwards
+// (VASP_read_wfc, QE_read_acsii_wfc) are stored with this precision as well
+  for(int i=0;i<nkpts;i++){ kpts[i].set_prec(_prec); }
+  prec = _prec;
+}
+
 void wfc::complete(){
+  if(gamma_only==1){
+    // The completed wfc is not built for the gamma trick: the overlaps are computed
+    // on the half set directly (see mo_overlaps), so here we only normalize it
+    for(int i=0;i<nkpts;i++){ kpts[i].normalize_gamma(); }
+    return;
+  }
   for(int i=0;i<nkpts;i++){ kpts[i].complete(); }
   npw = 2*npw - 1;
 }
 
 void wfc::normalize(){
-  for(int i=0;i<nkpts;i++){ kpts[i].normalize(); }
+  if(gamma_only==1){ for(int i=0;i<nkpts;i++){ kpts[i].normalize_gamma(); } }
+  else{ for(int i=0;i<nkpts;i++){ kpts[i].normalize(); } }
 }
 
 void wfc::transform(int k,matrix& T){
@@ -291,28 +365,35 @@ void wfc::restore(int k1,int do_complete){
 // *this - is a function which is to be transformed, it will be overwritten with the true one
 // k1 - is a k-point index of the wfc to be transformed
 // do_complete - the flag to indicate if we need to complete the input wfc first (=1) or not (=0)
+// Only the MOs with coefficients are transformed (e.g. the band range read by VASP_read_wfc),
+// they must be a contiguous range [b0,b1] of bands
 
 
   // Complete 
   if(do_complete==1){ complete(); }
 
-  // Compute overlap matrix
-  matrix S(nbands,nbands);
-
+  int b0 = -1, b1 = -1;
   for(int i=0;i<nbands;i++){
-    for(int j=0;j<nbands;j++){
-      S.M[i*nbands+j] = kpts[k1].mo[i].conj() * kpts[k1].mo[j];
-    }
+    if(kpts[k1].mo[i].npw>0){ if(b0==-1){ b0 = i; } b1 = i; }
+  }
+  if(b0==-1){ cout<<"Warning in restore: no MOs with coefficients at k-point "<<k1<<endl; return; }
+  for(int i=b0;i<=b1;i++){
+    if(kpts[k1].mo[i].npw==0){ cout<<"Error in restore: MOs with coefficients must be a contiguous range of bands\nExiting...\n"; exit(0); }
   }
+  int nb = b1 - b0 + 1;
+
+  // Compute overlap matrix
+  matrix S(nb,nb);
+  mo_overlaps(kpts[k1],kpts[k1],b0,b1,gamma_only==1,S);
 
   //cout<<"S matrix is formed\n";
   //cout<<"S = "<<S<<endl;
   // Find the transformation matrix T
   // which makes S matrix diagonal - eigenvalue problem
 
-  matrix eval(nbands,nbands);
-  matrix evec(nbands,nbands);
-  matrix eval_sqrt(nbands,nbands);
+  matrix eval(nb,nb);
+  matrix evec(nb,nb);
+  matrix eval_sqrt(nb,nb);
   //matrix evec_inv(nbands,nbands);
 
   //cout<<"entering eigen\n";
@@ -322,13 +403,19 @@ void wfc::restore(int k1,int do_complete){
   //evec.inverse(1e-12,evec_inv,1); // We don't need inverse - it is just .H()
   //cout<<"inverse = "<<evec_inv<<endl;
   eval_sqrt = 0.0;
-  for(i=0;i<nbands;i++){  eval_sqrt.M[i*nbands+i] = 1.0/ sqrt(eval.M[i*nbands+i]); }
+  for(int i=0;i<nb;i++){  eval_sqrt.M[i*nb+i] = 1.0/ sqrt(eval.M[i*nb+i]); }
 
-  matrix T(nbands,nbands);
+  matrix Tb(nb,nb);
 //  T = evec * eval_sqrt * evec_inv; // T = S^-1/2
-  T = evec.conj() * eval_sqrt.conj() * evec.T(); // T = (S^-1/2)^*, here evec^-1 = evec.H(), so (evec^-1)^* = evec^T
+  Tb = evec.conj() * eval_sqrt.conj() * evec.T(); // T = (S^-1/2)^*, here evec^-1 = evec.H(), so (evec^-1)^* = evec^T
 //  cout<<"T = "<<T<<endl;
 
+  // Bands outside of [b0,b1] have no coefficients, they are skipped by transform
+  matrix T(nbands,nbands);
+  for(int i=0;i<nb;i++){
+    for(int j=0;j<nb;j++){ T.M[(b0+i)*nbands+(b0+j)] = Tb.M[i*nb+j]; }
+  }
+
 
   // Finally, restore the real wavefunction (orthonormal)
   transform(k1,T);
@@ -379,7 +466,12 @@ void wfc::compute_Hprime(int minband,int maxband,std::string filename){
   int is_compl = 0;
   if(minband<0){ cout<<"Error in compute_Hprime: minband<0 : minband = "<<minband<<endl; exit(0); }
   if(maxband>=nbands){ cout<<"Error in compute_Hprime: maxband>=nbands : maxband = "<<maxband<<" nbands = "<<nbands<<endl; exit(0); }
-  if(g_sz!=npw){ 
+  if(gamma_only==1 && g_sz==npw){
+    // Half set of the gamma-point wfc: the same formula as for the completed one,
+    // which only uses its first g_sz plane waves anyway
+    is_compl = 1;
+  }
+  else if(g_sz!=npw){ 
     if(npw==(2*g_sz-1)){
       cout<<"Warning: Using reconstructed (completed) wavefunction\n";
       is_compl = 1;
@@ -416,7 +508,7 @@ void wfc::compute_Hprime(int minband,int maxband,std::string filename){
 
       for(int g=0;g<g_sz;g++){
         complex<double> tmp,gx,gy,gz;
-        tmp = ( (std::conj(kpts[0].mo[i].coeff[g])) * kpts[0].mo[j].coeff[g] );
+        tmp = ( (std::conj(kpts[0].mo[i].c(g))) * kpts[0].mo[j].c(g) );
         gx = scl*(grid[g][0]*b1[0] +  grid[g][1]*b2[0] +  grid[g][2]*b3[0]);
         gy = scl*(grid[g][0]*b1[1] +  grid[g][1]*b2[1] +  grid[g][2]*b3[1]);
         gz = scl*(grid[g][0]*b1[2] +  grid[g][1]*b2[2] +  grid[g][2]*b3[2]);
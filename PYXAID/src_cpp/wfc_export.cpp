@@ -15,10 +15,14 @@ using namespace boost::python;
 
 void export_wfc(){
 
+  void (wfc::*VASP_read_wfc1)(std::string) = &wfc::VASP_read_wfc;
+  void (wfc::*VASP_read_wfc2)(std::string,int,int,int) = &wfc::VASP_read_wfc;
+
   class_<wfc>("wfc",init<>())
     .def(init<wfc&,int,int,wfc&,int,int>())
     .def_readwrite("nspin",&wfc::nspin)
     .def_readwrite("gamma_only",&wfc::gamma_only)
+    .def_readwrite("prec",&wfc::prec)
     .def_readwrite("natoms",&wfc::natoms)
     .def_readwrite("tpiba",&wfc::tpiba)
     .def_readwrite("alat",&wfc::alat)
@@ -35,7 +39,10 @@ void export_wfc(){
     .def("QE_read_acsii_wfc",&wfc::QE_read_acsii_wfc)
     .def("QE_read_acsii_grid",&wfc::QE_read_acsii_grid)
     .def("QE_read_acsii_index",&wfc::QE_read_acsii_index)
+    .def("VASP_read_wfc",VASP_read_wfc1)
+    .def("VASP_read_wfc",VASP_read_wfc2)
 
+    .def("set_prec",&wfc::set_prec)
     .def("complete",&wfc::complete)
     .def("normalize",&wfc::normalize)
     .def("restore",&wfc::restore)
@@ -10,10 +10,73 @@
 #include "wfc.h"
 #include "matrix.h"
 #include "units.h"
+#include <algorithm>
 
 // Here we define a set of functions which are not the members of wfc, but
 // rather take wfc objects as arguments
 
+template<class T>
+void gather_mos(K_point& kp,int minband,int maxband,int npw,vector< complex<T> >& C){
+// C = coefficients of the orbitals [minband,maxband] of kp, one orbital per row of a nb x npw block
+// The rows of the orbitals without coefficients (npw = 0) are zero
+  C = vector< complex<T> >((maxband-minband+1)*npw,complex<T>(0.0,0.0));
+  for(int i=minband;i<=maxband;i++){
+    MO& mo = kp.mo[i];
+    if(mo.npw==0){ continue; }
+    if(mo.prec==1){ std::copy(mo.coeff_f.begin(),mo.coeff_f.begin()+npw,C.begin()+(i-minband)*npw); }
+    else{ std::copy(mo.coeff.begin(),mo.coeff.begin()+npw,C.begin()+(i-minband)*npw); }
+  }
+}
+
+void mo_overlaps(K_point& kp1,K_point& kp2,int minband,int maxband,int gamma,matrix& S){
+// Computes all overlaps S(i,j) = <kp1.mo[minband+i] | kp2.mo[minband+j]> of the orbitals in the range
+// [minband,maxband] with one matrix product: the coefficients of each set of orbitals are gathered
+// into a contiguous nb x npw block (one orbital per row) and S = conj(C1) * C2.T is done by gemm_dot
+// If all these orbitals are stored in float, so are the blocks (the sums are done in double)
+// gamma = 1: the orbitals are the half sets of the gamma-point wfcs (G=0 first, c(-G) = conj(c(G))),
+// then <i|j> = c_i0^* c_j0 + sum_{G>0} (c_iG^* c_jG + c_iG c_jG^*) = 2*Re(S_half) - c_i0 * c_j0^*, which
+// is 2*Re(S_half) - c_i0^* c_j0 for the real G=0 coefficients. No completed wfc is needed
+// The orbitals without coefficients (npw = 0, not read) are skipped: their overlaps are zero
+  int nb = maxband - minband + 1;
+  int npw = 0;
+  for(int i=minband;i<=maxband;i++){
+    if(kp1.mo[i].npw>0){ npw = kp1.mo[i].npw; break; }
+    if(kp2.mo[i].npw>0){ npw = kp2.mo[i].npw; break; }
+  }
+  int is_float = 1;
+  for(int i=minband;i<=maxband;i++){
+    if((kp1.mo[i].npw>0 && kp1.mo[i].npw!=npw) || (kp2.mo[i].npw>0 && kp2.mo[i].npw!=npw)){
+      cout<<"Error: Can not multiply MOs with different basis sizes\n"; exit(0);
+    }
+    if((kp1.mo[i].npw>0 && kp1.mo[i].prec!=1) || (kp2.mo[i].npw>0 && kp2.mo[i].prec!=1)){ is_float = 0; }
+  }
+
+  S = matrix(nb,nb);
+  if(npw==0){ return; }
+  if(is_float){
+    vector< complex<float> > C1, C2;
+    gather_mos(kp1,minband,maxband,npw,C1);
+    if(&kp2!=&kp1){ gather_mos(kp2,minband,maxband,npw,C2); }
+    gemm_dot(nb,nb,npw,&C1[0],(&kp2!=&kp1)? &C2[0] : &C1[0],S.M);
+  }
+  else{
+    vector< complex<double> > C1, C2;
+    gather_mos(kp1,minband,maxband,npw,C1);
+    if(&kp2!=&kp1){ gather_mos(kp2,minband,maxband,npw,C2); }
+    gemm_dot(nb,nb,npw,&C1[0],(&kp2!=&kp1)? &C2[0] : &C1[0],S.M);
+  }
+
+  if(gamma){
+    for(int i=0;i<nb;i++){
+      if(kp1.mo[minband+i].npw==0){ continue; }
+      for(int j=0;j<nb;j++){
+        if(kp2.mo[minband+j].npw==0){ continue; }
+        S.M[i*nb+j] = 2.0*S.M[i*nb+j].real() - kp1.mo[minband+i].c(0)*std::conj(kp2.mo[minband+j].c(0));
+      }
+    }
+  }
+}
+
 void overlap(wfc& wfc1,int k1,int minband,int maxband,std::string filename){
 // This function computes the overlap of the wavefunctions at given k-point
 // and writes the overlap matrix in files filename_re and filename_im
@@ -23,11 +86,14 @@ void overlap(wfc& wfc1,int k1,int minband,int maxband,std::string filename){
 
   ofstream f_re((filename+"_re").c_str(),ios::out);
   ofstream f_im((filename+"_im").c_str(),ios::out);
-  int sz = wfc1.nbands;
+  int nb = maxband - minband + 1;
+
+  matrix S;
+  mo_overlaps(wfc1.kpts[k1],wfc1.kpts[k1],minband,maxband,wfc1.gamma_only==1,S);
   
   for(int i=minband;i<=maxband;i++){
     for(int j=minband;j<=maxband;j++){
-      complex<double> res = wfc1.kpts[k1].mo[i].conj() * wfc1.kpts[k1].mo[j];   
+      complex<double> res = S.M[(i-minband)*nb+(j-minband)];
       f_re<<res.real()<<"  ";
       f_im<<res.imag()<<"  ";
     }// for j
@@ -69,10 +135,17 @@ void nac(wfc& wfc1,wfc& wfc2,int k1,int k2,int minband,int maxband,double dt,std
   ofstream f_im((filename+"_im").c_str(),ios::out);
 
   if(wfc1.nbands!=wfc2.nbands){ cout<<"Error in overlap: Wavefunctions have different number of bands\n"; exit(0); }
+
+  // Only the cross-overlap S12(i,j) = <i(t)|j(t+dt)> is computed, because
+  // <i(t+dt)|j(t)> = conj(<j(t)|i(t+dt)>) = conj(S12(j,i))
+  int nb = maxband - minband + 1;
+  matrix S12;
+  mo_overlaps(wfc1.kpts[k1],wfc2.kpts[k2],minband,maxband,wfc1.gamma_only==1 && wfc2.gamma_only==1,S12);
+
   for(int i=minband;i<=maxband;i++){
     for(int j=minband;j<=maxband;j++){
-      complex<double> res1 = wfc1.kpts[k1].mo[i].conj() * wfc2.kpts[k2].mo[j];
-      complex<double> res2 = wfc2.kpts[k2].mo[i].conj() * wfc1.kpts[k1].mo[j];
+      complex<double> res1 = S12.M[(i-minband)*nb+(j-minband)];
+      complex<double> res2 = std::conj(S12.M[(j-minband)*nb+(i-minband)]);
       complex<double> res = (0.5/dt)*(res1 - res2);
  
       f_re<<res.real()<<"  ";
@@ -132,10 +205,17 @@ void ham(wfc& wfc1,wfc& wfc2,int k1,int k2,int minband,int maxband,double dt,std
   ofstream f_im((filename+"_im").c_str(),ios::out);
 
   if(wfc1.nbands!=wfc2.nbands){ cout<<"Error in overlap: Wavefunctions have different number of bands\n"; exit(0); }
+
+  // Only the cross-overlap S12(i,j) = <i(t)|j(t+dt)> is computed, because
+  // <i(t+dt)|j(t)> = conj(<j(t)|i(t+dt)>) = conj(S12(j,i))
+  int nb = maxband - minband + 1;
+  matrix S12;
+  mo_overlaps(wfc1.kpts[k1],wfc2.kpts[k2],minband,maxband,wfc1.gamma_only==1 && wfc2.gamma_only==1,S12);
+
   for(int i=minband;i<=maxband;i++){
     for(int j=minband;j<=maxband;j++){
-      complex<double> res1 = wfc1.kpts[k1].mo[i].conj() * wfc2.kpts[k2].mo[j];
-      complex<double> res2 = wfc2.kpts[k2].mo[i].conj() * wfc1.kpts[k1].mo[j];
+      complex<double> res1 = S12.M[(i-minband)*nb+(j-minband)];
+      complex<double> res2 = std::conj(S12.M[(j-minband)*nb+(i-minband)]);
       complex<double> res = ihbar*(0.5/dt)*(res1 - res2);
 
       if(i==j){ res += 0.5*(wfc1.kpts[k1].mo[i].energy + wfc2.kpts[k2].mo[i].energy); }
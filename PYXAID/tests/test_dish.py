@@ -0,0 +1,139 @@
+#***********************************************************
+# * Copyright (C) 2013 Alexey V. Akimov
+# * This file is distributed under the terms of the
+# * GNU General Public License as published by the
+# * Free Software Foundation; either version 3 of the
+# * License, or (at your option) any later version.
+# * http://www.gnu.org/copyleft/gpl.txt
+#***********************************************************/
+
+# Consistency checks of the DISH (decoherence = 1) surface hopping paths
+# on a small synthetic 4-orbital system:
+#  - trajectories propagated in batches (sh_batch > 0) vs one at a time
+#  - decoherence rates reused between steps (dish_events = 1) vs updated
+#    every step (dish_events = 0)
+# The SH populations of two runs with different random numbers must agree
+# within the binomial sampling noise.
+#
+# Usage: python test_dish.py [directory with pyxaid_core.so]
+
+from __future__ import print_function
+import sys, os, math, random, shutil, tempfile
+
+if len(sys.argv)>1:
+    sys.path.insert(0, sys.argv[1])
+import pyxaid_core
+
+nfiles = 120     # number of Hamiltonian files
+norb = 6         # orbitals in the files, the active space is [2,3,4,5]
+nsigma = 4.0     # tolerance in units of the standard deviation
+
+
+def make_hamiltonians(dirname):
+    # Orbital energies (Ry) fluctuate around fixed levels, the couplings
+    # (imaginary part, antisymmetric) oscillate in time
+    rnd = random.Random(12345)
+    levels = [-0.9, -0.31, -0.30, -0.295, -0.288, 0.5]
+    for t in range(nfiles):
+        f_re = open(os.path.join(dirname, "Ham_%i_re" % t), "w")
+        f_im = open(os.path.join(dirname, "Ham_%i_im" % t), "w")
+        e = [levels[a] + 0.006*rnd.gauss(0.0, 1.0) for a in range(norb)]
+        for a in range(norb):
+            re = []; im = []
+            for b in range(norb):
+                re.append(e[a] if a==b else 0.0)
+                x = 0.0
+                if a!=b:
+                    x = 0.015*math.sin(0.1*t + a - 2*b) if a<b else -0.015*math.sin(0.1*t + b - 2*a)
+                im.append(x)
+            f_re.write("  ".join("%.10e" % x for x in re) + "\n")
+            f_im.write("  ".join("%.10e" % x for x in im) + "\n")
+        f_re.close()
+        f_im.close()
+
+
+def run(ham_dir, scratch, extra):
+    params = {}
+    params["Ham_re_prefix"] = os.path.join(ham_dir, "Ham_")
+    params["Ham_re_suffix"] = "_re"
+    params["Ham_im_prefix"] = os.path.join(ham_dir, "Ham_")
+    params["Ham_im_suffix"] = "_im"
+    params["energy_units"] = "Ry"
+    params["scratch_dir"] = scratch
+    params["read_couplings"] = "batch"
+    params["runtype"] = "namd"
+    params["decoherence"] = 1
+    params["is_field"] = 0
+    params["elec_dt"] = 0.05
+    params["nucl_dt"] = 1.0
+    params["integrator"] = 0
+    params["namdtime"] = 40
+    params["num_sh_traj"] = 1000
+    params["boltz_flag"] = 1
+    params["Temp"] = 300.0
+    params["alp_bet"] = 0
+    params["debug_flag"] = 0
+    params["active_space"] = [2,3,4,5]
+    params["states"] = [["GS",[2,-2,3,-3],0.0],["S1",[2,-2,3,-4],0.0],["S2",[2,-2,3,-5],0.0],["S3",[2,-4,3,-3],0.0]]
+    params["iconds"] = [[0,3],[30,3]]
+    params.update(extra)
+
+    os.makedirs(scratch)
+    pyxaid_core.namd(params)
+
+    # SH populations averaged over the initial conditions
+    pops = None
+    for icond in range(len(params["iconds"])):
+        rows = []
+        for line in open(os.path.join(scratch, "out%i" % icond)):
+            w = line.split()
+            rows.append([float(w[k]) for k in range(3, len(w), 2)])
+        if pops is None:
+            pops = rows
+        else:
+            pops = [[x+y for x,y in zip(a,b)] for a,b in zip(pops,rows)]
+    nc = float(len(params["iconds"]))
+    ntraj = params["num_sh_traj"]*len(params["iconds"])
+    return [[x/nc for x in a] for a in pops], ntraj
+
+
+def compare(name, res1, res2):
+    # Largest deviation of the populations in units of the binomial standard deviation
+    p1, n1 = res1
+    p2, n2 = res2
+    worst = 0.0; dmax = 0.0
+    for a,b in zip(p1,p2):
+        for x,y in zip(a,b):
+            p = 0.5*(x+y)
+            sigma = math.sqrt(max(p*(1.0-p), 1.0/n1)*(1.0/n1 + 1.0/n2))
+            worst = max(worst, abs(x-y)/sigma)
+            dmax = max(dmax, abs(x-y))
+    ok = worst < nsigma
+    print("%-40s max|dP| = %.4f  (%.2f sigma)  %s" % (name, dmax, worst, "OK" if ok else "FAILED"))
+    return ok
+
+
+def main():
+    tmp = tempfile.mkdtemp(prefix="pyxaid_dish_")
+    ok = True
+    try:
+        make_hamiltonians(tmp)
+
+        serial = run(tmp, os.path.join(tmp, "serial"), {"sh_batch":0})
+        batch  = run(tmp, os.path.join(tmp, "batch"), {"sh_batch":64})
+        ok = compare("DISH: sh_batch = 64 vs serial", serial, batch) and ok
+
+        for tol in [0.0, 0.01]:
+            ev = run(tmp, os.path.join(tmp, "events_%s" % tol), {"sh_batch":0, "dish_events":1, "dish_pop_tol":tol})
+            ok = compare("DISH: dish_events = 1 (tol = %s) vs 0" % tol, serial, ev) and ok
+
+    finally:
+        shutil.rmtree(tmp)
+
+    if not ok:
+        sys.exit(1)
+    print("All DISH checks passed")
+
+
+if __name__=="__main__":
+    main()